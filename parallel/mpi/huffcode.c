@@ -20,12 +20,8 @@ extern char* optarg;
 #include <unistd.h>
 #endif
 
-#define THREADS 4
-
-static unsigned int memory_encode_read_file(FILE *in,
-									   unsigned char **buf, unsigned long sz);
-static unsigned int memory_decode_read_file(FILE *in,
-									   unsigned char **buf, unsigned long sz);
+static size_t memory_encode_read_file(FILE *in,
+									   unsigned char **buf, uint64_t sz);
 
 static void
 version(FILE *out)
@@ -39,12 +35,22 @@ version(FILE *out)
 static void
 usage(FILE* out)
 {
-	fputs("Usage: huffcode [-i<input file>] [-o<output file>] [-d|-c]\n"
-		  "-i - input file (default is standard input)\n"
+	fputs("Usage: huffcode -i<input file> [-o<output file>] [-d|-c]"
+		  " [-b<bits>] [-s<streams>] [-p]\n"
+		  "-i - input file, read by every task\n"
 		  "-o - output file (default is standard output)\n"
-		  "-d - decompress\n"
+		  "-d - decompress. With -o all the tasks decompress a stream of"
+		  " blocks;\n"
+		  "     otherwise, and for a single image, task 0 decompresses"
+		  " alone\n"
 		  "-c - compress (default)\n"
-		  "-m - read file into memory, compress, then write to file (not default)\n",
+		  "-b - longest code in bits when compressing (default 32)\n"
+		  "-s - bitstreams per block when compressing, for faster decoding"
+		  " (default 1,\n"
+		  "     more needs -p)\n"
+		  "-p - code independent blocks with an index when compressing, so"
+		  " that all\n"
+		  "     the tasks can decompress them (needs -o)\n",
 		  out);
 }
 
@@ -54,12 +60,14 @@ main(int argc, char** argv)
 	unsigned char *buf = NULL;
 	char memory = 1;
 	char compress = 1;
-	int opt;
-	unsigned int i, j, cur;
+	char blocks = 0;
+	int opt, rc;
+	unsigned int i;
+	size_t cur;
 	const char *file_in = NULL, *file_out = NULL;
 	
 	unsigned char* bufout = NULL;
-	unsigned int bufoutlen = 0;
+	uint64_t bufoutlen = 0;
 	
 	int rank = -1, nTasks = -1;
 
@@ -71,9 +79,13 @@ main(int argc, char** argv)
 	MPI_Comm_size (MPI_COMM_WORLD, &nTasks);
 
 	FILE *out = stdout;
+	MPI_File fh;
+	huffman_params params;
+
+	huffman_params_init(&params);
 
 	/* Get the command line arguments. */
-	while((opt = getopt(argc, argv, "i:o:cdhvm")) != -1)
+	while((opt = getopt(argc, argv, "i:o:cdhvb:s:p")) != -1)
 	{
 		switch(opt)
 		{
@@ -89,44 +101,98 @@ main(int argc, char** argv)
 		case 'd':
 			compress = 0;
 			break;
+		case 'p':
+			blocks = 1;
+			break;
+		case 'b':
+			params.max_bits = (unsigned int)atoi(optarg);
+			if(params.max_bits < 1 || params.max_bits > HUFFMAN_MAX_CODE_BITS)
+			{
+				fprintf(stderr, "Code length must be from 1 to %d bits\n",
+						HUFFMAN_MAX_CODE_BITS);
+				MPI_Finalize();
+				return 1;
+			}
+			break;
+		case 's':
+			params.streams = (unsigned int)atoi(optarg);
+			if(params.streams < 1 || params.streams > HUFFMAN_MAX_STREAMS)
+			{
+				fprintf(stderr, "Streams must be from 1 to %d\n",
+						HUFFMAN_MAX_STREAMS);
+				MPI_Finalize();
+				return 1;
+			}
+			break;
 		case 'h':
-			usage(stdout);
+			if(rank == 0)
+				usage(stdout);
+			MPI_Finalize();
 			return 0;
 		case 'v':
-			version(stdout);
+			if(rank == 0)
+				version(stdout);
+			MPI_Finalize();
 			return 0;
 		default:
-			usage(stderr);
+			if(rank == 0)
+				usage(stderr);
+			MPI_Finalize();
 			return 1;
 		}
 	}
 
+	if(blocks && !file_out)
+	{
+		if(rank == 0)
+			fprintf(stderr, "-p needs an output file (-o)\n");
+		MPI_Finalize();
+		return 1;
+	}
+
+	/* The tasks code a single image as one stream between them.
+	   Only independent blocks can each be split into streams. */
+	if(params.streams > 1 && !blocks)
+	{
+		if(rank == 0)
+			fprintf(stderr, "-s needs -p\n");
+		MPI_Finalize();
+		return 1;
+	}
+
 	FILE *fp;
 
-	/* If an input file is given then open it
-	 * on several positions
-	 */
-	if(file_in)
+	/* Every task reads its own slice, so the input must be a file. */
+	if(!file_in)
 	{
-			fp = fopen(file_in, "rb");
-			if(!fp)
-			{
-				fprintf(stderr,
-						"Can't open input file '%s': %s\n",
-						file_in, strerror(errno));
-				exit(1);
-			}
+		if(rank == 0)
+			fprintf(stderr, "Reading with several tasks needs an input file\n");
+		MPI_Finalize();
+		return 1;
 	}
 
-	/* If an output file is given then create it. */
+	/* Every task opens the input file to read its own slice. */
+	fp = fopen(file_in, "rb");
+	if(!fp)
+	{
+		fprintf(stderr,
+				"Can't open input file '%s': %s\n",
+				file_in, strerror(errno));
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	/* If an output file is given then create it. Every task
+	 * opens it to write its own part.
+	 */
 	if(file_out)
 	{
-		out = fopen(file_out, "wb");
-		if(!out)
+		if(MPI_File_open(MPI_COMM_WORLD, (char *)file_out,
+						 MPI_MODE_CREATE | MPI_MODE_WRONLY,
+						 MPI_INFO_NULL, &fh) != MPI_SUCCESS)
 		{
-			fprintf(stderr,
-					"Can't open output file '%s': %s\n",
-					file_out, strerror(errno));
+			if(rank == 0)
+				fprintf(stderr, "Can't open output file '%s'\n", file_out);
+			MPI_Finalize();
 			return 1;
 		}
 	}
@@ -134,20 +200,19 @@ main(int argc, char** argv)
 	/**
 	 * Get file size
 	 */
-	unsigned long sz = 0;
-	int to_read[nTasks];
-	int displs[nTasks];
+	uint64_t sz = 0;
+	uint64_t to_read[nTasks];
 
 	if (rank == 0) {
 		fseek(fp, 0L, SEEK_END);
-		sz = (unsigned long)ftell(fp);
+		sz = (uint64_t)ftell(fp);
 		fseek(fp, 0L, SEEK_SET);
 	}
 
 	/**
 	 * Sending the size to read
 	 */
-	MPI_Bcast (&sz, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+	MPI_Bcast (&sz, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
 
 	for (i = 0; i < nTasks; ++i) {
 		if (i == nTasks - 1) {
@@ -155,110 +220,82 @@ main(int argc, char** argv)
 		} else {
 			to_read[i] = sz / nTasks;
 		}
-		
-		displs[i] = 0;
-
-		for (j = 0; j < i; ++j) {
-			displs[i] += to_read[j];
-		}
 	}
 	
 	/**
 	 * Increment each file pointer to its specific chunk size
 	 */
-	fseek(fp, rank * (unsigned long) (sz / nTasks), SEEK_SET);			
+	fseek(fp, (long)((uint64_t)rank * (sz / nTasks)), SEEK_SET);
 	
 	if(memory)
 	{
 		if (compress) {
 
-			cur = memory_encode_read_file(fp, &buf, to_read[rank]);
-			// printf("rank: %d, to_read: %d\n", rank, to_read[rank]);
-			/**
-			 * Copy the contents of all 
-			 * partial buffers into one
-			 */
-
-			char *text;
-
-			text = malloc(sz * sizeof(char));					
-
-			MPI_Gatherv(buf, to_read[rank], MPI_CHAR, text, to_read, displs, MPI_CHAR, 0, MPI_COMM_WORLD);
-
-			MPI_Bcast (text, sz, MPI_CHAR, 0, MPI_COMM_WORLD);
+			cur = to_read[rank] ?
+				memory_encode_read_file(fp, &buf, to_read[rank]) : 0;
+			if(cur != to_read[rank])
+			{
+				fprintf(stderr, "Can't read input file '%s'\n", file_in);
+				MPI_Abort(MPI_COMM_WORLD, 1);
+			}
 
 			/**
-			 * Do actual huffman algorithm
-			 * TODO - add 1 thread to write to memory the table
-			 *		- add 4 threads to write to memory their segments of content
+			 * Every task codes the piece it has read. Only the
+			 * counts of the symbols are shared between them, and
+			 * with an output file every task writes its own part.
 			 */
-			
-			if(huffman_encode_memory(text, sz, &bufout, &bufoutlen, rank, nTasks, MPI_COMM_WORLD))
+			if(file_out)
 			{
-				free(text);
-				return 1;
+				rc = blocks ?
+					huffman_encode_blocks_to_file(buf, cur, fh, &params, rank, nTasks, MPI_COMM_WORLD) :
+					huffman_encode_memory_to_file(buf, cur, fh, &params, rank, nTasks, MPI_COMM_WORLD);
+				MPI_File_close(&fh);
 			}
+			else
+				rc = huffman_encode_memory64_ex(buf, cur, &bufout, &bufoutlen, &params, rank, nTasks, MPI_COMM_WORLD);
 
-			// free(scarlat);
+			free(buf);
+			if(rc)
+				MPI_Abort(MPI_COMM_WORLD, 1);
 
-			if (rank == 0) {
+			if (rank == 0 && !file_out) {
 				// Write the memory to the file. 
-				if(fwrite(bufout, 1, bufoutlen, out) != bufoutlen)
+				if(fwrite(bufout, 1, (size_t)bufoutlen, out) != bufoutlen)
 				{
-					free(bufout);
-					return 1;
+					fprintf(stderr, "Can't write the output\n");
+					MPI_Abort(MPI_COMM_WORLD, 1);
 				}
 
 				free(bufout);
 			}
 		}
-		else {
-			// int a, pos = 0;
-			// unsigned long size = sz / THREADS;
-
-			// #pragma omp parallel for schedule(dynamic) \
-			// num_threads(THREADS)
-			// for(i = 0; i < THREADS; ++i) {
-			// 	if (i == THREADS - 1) {
-			// 		size = sz - (THREADS - 1) * size;
-			// 	}
-			// 	cur[i] = memory_decode_read_file(fp[i], &buf[i], size);
-			// }
-
-			// unsigned int sum = 0;
-			// for(i = 0; i < THREADS; i++) {
-			// 	sum += cur[i];
-			// }
-
-			// char *scarlat = malloc(sum * sizeof(char));
-
-			// for (i = 0; i <	THREADS; ++i) {
-			// 	memcpy(scarlat + pos, buf[i], cur[i]);
-			// 	pos += cur[i];
-			// }
-
-			// // for (i = 0; i < THREADS; i++) {
-			// // 	free(buf[i]);
-			// // 	buf[i] = NULL;
-			// // }
-
-			// /* Decode the memory. */
-			// if(huffman_decode_memory(scarlat, sum, &bufout, &bufoutlen))
-			// {
-			// 	free(scarlat);
-			// 	return 1;
-			// }
-
-			// free(scarlat);
-
-			// // Write the memory to the file. 
-			// if(fwrite(bufout, 1, bufoutlen, out) != bufoutlen)
-			// {
-			// 	free(bufout);
-			// 	return 1;
-			// }
-
-			// free(bufout);
+		else if(file_out) {
+			MPI_File fin;
+
+			/**
+			 * Every task reads, decodes and writes its own
+			 * share of the blocks.
+			 */
+			if(MPI_File_open(MPI_COMM_WORLD, (char *)file_in, MPI_MODE_RDONLY,
+							 MPI_INFO_NULL, &fin) != MPI_SUCCESS)
+			{
+				if(rank == 0)
+					fprintf(stderr, "Can't open input file '%s'\n", file_in);
+				MPI_File_close(&fh);
+				MPI_Finalize();
+				return 1;
+			}
+
+			rc = huffman_decode_to_file(fin, fh, rank, nTasks, MPI_COMM_WORLD);
+			MPI_File_close(&fin);
+			MPI_File_close(&fh);
+			if(rc)
+				MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		else if(rank == 0) {
+			/* Rank 0 decodes to standard output on its own. */
+			if(huffman_decode_file(fp, out))
+				MPI_Abort(MPI_COMM_WORLD, 1);
 		}
 
 		MPI_Finalize();
@@ -267,75 +304,16 @@ main(int argc, char** argv)
 	}
 }
 
-static unsigned int
+static size_t
 memory_encode_read_file(FILE *in,
-				   unsigned char **buf, unsigned long sz)
-{
-	unsigned int i, len = 0, cur = 0, inc = 1024;
-
-	assert(in);
-
-	/* Read the file into memory. */
-	for(i = 0; i < (unsigned int)sz; i += inc)
-	{
-		//printf("%d\n", omp_get_thread_num());
-		unsigned char *tmp;
-		len += inc;
-		tmp = (unsigned char*)realloc(*buf, len);
-		if(!tmp)
-		{
-			if(*buf)
-				free(buf);
-			return -1;
-		}
-
-		*buf = tmp;
-		if(cur + inc > sz) {
-			cur += fread(*buf + cur, 1, (unsigned int)(sz - cur), in);
-		} 
-		else {
-			cur += fread(*buf + cur, 1, inc, in);
-		}
-	}
-
-	if(NULL != *buf) {
-		return cur;
-	}
-	return -1;
-}
-
-static unsigned int
-memory_decode_read_file(FILE *in,
-				   unsigned char **buf, unsigned long sz)
+				   unsigned char **buf, uint64_t sz)
 {
-	unsigned int i, len = 0, cur = 0, inc = 1024;
 	assert(in);
 
-	/* Read the file into memory. */
-	for (i = 0; i < (unsigned int)sz; i+=inc)
-	{
-		unsigned char *tmp;
-		len += inc;
-		tmp = (unsigned char*)realloc(*buf, len);
-		if(!tmp)
-		{
-			if(*buf) {
-				free(*buf);
-			}
-			return 1;
-		}
+	/* Read the piece into memory, allocated once at its size. */
+	*buf = (unsigned char*)malloc(sz ? (size_t)sz : 1);
+	if(!*buf)
+		return (size_t)-1;
 
-		*buf = tmp;
-		if(cur + inc > sz) {
-			cur += fread(*buf + cur, 1, (unsigned int)(sz - cur), in);
-		} 
-		else {
-			cur += fread(*buf + cur, 1, inc, in);
-		}
-	}
-
-	if(NULL != *buf) {
-		return cur;
-	}
-	return -1;
+	return fread(*buf, 1, (size_t)sz, in);
 }
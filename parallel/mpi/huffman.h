@@ -11,8 +11,56 @@
 #include <stdint.h>
 #include <mpi.h>
 
+/* The longest code the encoder ever produces. */
+#define HUFFMAN_MAX_CODE_BITS 32
+
+/* The default and the largest number of input bytes
+   in each block written by huffman_encode_file. */
+#define HUFFMAN_DEFAULT_BLOCK_SIZE (1u << 20)
+#define HUFFMAN_MAX_BLOCK_SIZE (1u << 26)
+
+/* The largest number of bitstreams an image can be split into. */
+#define HUFFMAN_MAX_STREAMS 8
+
+typedef struct huffman_params_tag
+{
+	/* The longest code to produce, from 1 to HUFFMAN_MAX_CODE_BITS.
+	   Short limits such as 11 or 12 keep the decode tables small,
+	   at a slight cost in compression on skewed input. The limit
+	   is raised if it leaves too few codes for the symbols. */
+	unsigned int max_bits;
+
+	/* The number of input bytes in each block written by
+	   huffman_encode_file_ex, from 1 to HUFFMAN_MAX_BLOCK_SIZE.
+	   Every block has its own code table, and memory use
+	   depends on the block size rather than the input size. */
+	unsigned int block_size;
+
+	/* Non-zero to end the blocks with an index of where each one
+	   starts in the encoded and the decoded data, so that a
+	   decoder can find every block without walking the others.
+	   Decoders that do not use the index skip it. */
+	int block_index;
+
+	/* The number of bitstreams each image is split into, from 1 to
+	   HUFFMAN_MAX_STREAMS. The streams share the code table and
+	   take the symbols in turn, so a decoder can follow several of
+	   them at once; 4 or 8 streams decode fastest on most CPUs.
+	   Decoders older than this option cannot read more than 1.
+	   The tasks code a single image as one stream, so only
+	   huffman_encode_blocks_to_file takes more than 1 here. */
+	unsigned int streams;
+} huffman_params;
+
+void huffman_params_init(huffman_params *params);
+
 int huffman_encode_file(FILE *in, FILE *out);
+int huffman_encode_file_ex(FILE *in, FILE *out, const huffman_params *params);
 int huffman_decode_file(FILE *in, FILE *out);
+
+/* Every task of communicator passes its own piece of the input, the
+   pieces in rank order making up the whole. The tasks agree on one
+   code table and rank 0 receives the encoded data. */
 int huffman_encode_memory(const unsigned char *bufin,
 						  uint32_t bufinlen,
 						  unsigned char **pbufout,
@@ -20,9 +68,74 @@ int huffman_encode_memory(const unsigned char *bufin,
 						  int rank,
 						  int nTasks,
 						  MPI_Comm communicator);
+int huffman_encode_memory_ex(const unsigned char *bufin,
+							 uint32_t bufinlen,
+							 unsigned char **pbufout,
+							 uint32_t *pbufoutlen,
+							 const huffman_params *params,
+							 int rank,
+							 int nTasks,
+							 MPI_Comm communicator);
 int huffman_decode_memory(const unsigned char *bufin,
 						  uint32_t bufinlen,
 						  unsigned char **bufout,
 						  uint32_t *pbufoutlen);
 
+/* The same as above for buffers of 4 GiB or more. The 32-bit
+   versions fail when a length does not fit in 32 bits. */
+int huffman_encode_memory64(const unsigned char *bufin,
+							uint64_t bufinlen,
+							unsigned char **pbufout,
+							uint64_t *pbufoutlen,
+							int rank,
+							int nTasks,
+							MPI_Comm communicator);
+int huffman_encode_memory64_ex(const unsigned char *bufin,
+							   uint64_t bufinlen,
+							   unsigned char **pbufout,
+							   uint64_t *pbufoutlen,
+							   const huffman_params *params,
+							   int rank,
+							   int nTasks,
+							   MPI_Comm communicator);
+int huffman_decode_memory64(const unsigned char *bufin,
+							uint64_t bufinlen,
+							unsigned char **bufout,
+							uint64_t *pbufoutlen);
+
+/* Code the pieces of the tasks as huffman_encode_memory64_ex does,
+   but have every task write the bytes it codes straight into out,
+   which all the tasks of communicator have opened together. Only
+   the lengths of the pieces and the bits they share at their ends
+   are exchanged, so no task ever holds the whole output. */
+int huffman_encode_memory_to_file(const unsigned char *bufin,
+								  uint64_t bufinlen,
+								  MPI_File out,
+								  const huffman_params *params,
+								  int rank,
+								  int nTasks,
+								  MPI_Comm communicator);
+
+/* Like huffman_encode_memory_to_file, but every task cuts its piece
+   into blocks of params->block_size bytes with their own code tables
+   and the blocks are written as a stream of blocks with an index,
+   which huffman_decode_to_file can share out between the tasks. */
+int huffman_encode_blocks_to_file(const unsigned char *bufin,
+								  uint64_t bufinlen,
+								  MPI_File out,
+								  const huffman_params *params,
+								  int rank,
+								  int nTasks,
+								  MPI_Comm communicator);
+
+/* Decode in into out, which the tasks of communicator have opened
+   together. A stream of blocks is decoded on all the tasks, each
+   reading, decoding and writing a run of blocks of its own. Any
+   other encoded data is decoded by rank 0. */
+int huffman_decode_to_file(MPI_File in,
+						   MPI_File out,
+						   int rank,
+						   int nTasks,
+						   MPI_Comm communicator);
+
 #endif
@@ -20,12 +20,10 @@ extern char* optarg;
 #include <unistd.h>
 #endif
 
-#define THREADS 4
-
-static unsigned int memory_encode_read_file(FILE *in,
-									   unsigned char **buf, unsigned long sz);
-static unsigned int memory_decode_read_file(FILE *in,
-									   unsigned char **buf, unsigned long sz);
+static size_t memory_encode_read_file(FILE *in,
+									   unsigned char **buf, uint64_t sz);
+static size_t memory_decode_read_file(FILE *in,
+									   unsigned char **buf, uint64_t sz);
 
 static void
 version(FILE *out)
@@ -39,11 +37,17 @@ version(FILE *out)
 static void
 usage(FILE* out)
 {
-	fputs("Usage: huffcode [-i<input file>] [-o<output file>] [-d|-c]\n"
+	fputs("Usage: huffcode [-i<input file>] [-o<output file>] [-d|-c]"
+		  " [-b<bits>] [-s<streams>] [-j<threads>] [-x]\n"
 		  "-i - input file (default is standard input)\n"
 		  "-o - output file (default is standard output)\n"
 		  "-d - decompress\n"
 		  "-c - compress (default)\n"
+		  "-b - longest code in bits when compressing (default 32)\n"
+		  "-s - bitstreams per block when compressing, for faster decoding"
+		  " (default 1)\n"
+		  "-j - threads to use (default is the number of CPUs available)\n"
+		  "-x - index the blocks when compressing, for parallel decoding\n"
 		  "-m - read file into memory, compress, then write to file (not default)\n",
 		  out);
 }
@@ -51,20 +55,24 @@ usage(FILE* out)
 int
 main(int argc, char** argv)
 {
-	unsigned char *buf[THREADS] = {NULL, NULL, NULL, NULL};
-	char memory = 1;
+	unsigned char **buf;
+	char memory = 0;
 	char compress = 1;
 	int opt;
-	unsigned int i, cur[THREADS];
+	unsigned int i, nthreads;
+	size_t *cur;
 	const char *file_in = NULL, *file_out = NULL;
 	
 	unsigned char* bufout = NULL;
-	unsigned int bufoutlen = 0;
+	uint64_t bufoutlen = 0;
 	
 	FILE *out = stdout;
+	huffman_params params;
+
+	huffman_params_init(&params);
 
 	/* Get the command line arguments. */
-	while((opt = getopt(argc, argv, "i:o:cdhvm")) != -1)
+	while((opt = getopt(argc, argv, "i:o:cdhvmb:s:j:x")) != -1)
 	{
 		switch(opt)
 		{
@@ -80,6 +88,39 @@ main(int argc, char** argv)
 		case 'd':
 			compress = 0;
 			break;
+		case 'm':
+			memory = 1;
+			break;
+		case 'x':
+			params.block_index = 1;
+			break;
+		case 'b':
+			params.max_bits = (unsigned int)atoi(optarg);
+			if(params.max_bits < 1 || params.max_bits > HUFFMAN_MAX_CODE_BITS)
+			{
+				fprintf(stderr, "Code length must be from 1 to %d bits\n",
+						HUFFMAN_MAX_CODE_BITS);
+				return 1;
+			}
+			break;
+		case 's':
+			params.streams = (unsigned int)atoi(optarg);
+			if(params.streams < 1 || params.streams > HUFFMAN_MAX_STREAMS)
+			{
+				fprintf(stderr, "Streams must be from 1 to %d\n",
+						HUFFMAN_MAX_STREAMS);
+				return 1;
+			}
+			break;
+		case 'j':
+			params.threads = (unsigned int)atoi(optarg);
+			if(params.threads < 1 || params.threads > HUFFMAN_MAX_THREADS)
+			{
+				fprintf(stderr, "Threads must be from 1 to %d\n",
+						HUFFMAN_MAX_THREADS);
+				return 1;
+			}
+			break;
 		case 'h':
 			usage(stdout);
 			return 0;
@@ -92,7 +133,18 @@ main(int argc, char** argv)
 		}
 	}
 
-	FILE *fp[THREADS];
+	/* The file is read into memory on as many threads as
+	 * it is coded on, each with its own file pointer.
+	 */
+	nthreads = params.threads;
+	FILE **fp = calloc(nthreads, sizeof(*fp));
+	buf = calloc(nthreads, sizeof(*buf));
+	cur = calloc(nthreads, sizeof(*cur));
+	if(!fp || !buf || !cur)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
 
 	/* If an input file is given then open it
 	 * on several positions
@@ -100,8 +152,8 @@ main(int argc, char** argv)
 	if(file_in)
 	{
 		#pragma omp parallel for schedule(dynamic) \
-		num_threads(THREADS)
-		for (i = 0; i < THREADS; ++i) {
+		num_threads(nthreads)
+		for (i = 0; i < nthreads; ++i) {
 			fp[i] = fopen(file_in, "rb");
 			if(!fp[i])
 			{
@@ -126,21 +178,41 @@ main(int argc, char** argv)
 		}
 	}
 
+	/**
+	 * Unless the file is to be read into memory, stream
+	 * it through the library one block at a time
+	 */
+	if(!memory)
+	{
+		FILE *in = file_in ? fp[0] : stdin;
+
+		return compress ?
+			huffman_encode_file_ex(in, out, &params) :
+			huffman_decode_file_ex(in, out, &params);
+	}
+
+	/* The pieces of the file are read with a file pointer each. */
+	if(!file_in)
+	{
+		fprintf(stderr, "Reading into memory needs an input file\n");
+		return 1;
+	}
+
 	/**
 	 * Get file size
 	 */
 	fseek(fp[0], 0L, SEEK_END);
-	unsigned long sz = (unsigned long)ftell(fp[0]);
+	uint64_t sz = (uint64_t)ftell(fp[0]);
 	fseek(fp[0], 0L, SEEK_SET);
 
 	/**
 	 * Increment each file pointer to its specific chunk size
 	 */
 	#pragma omp parallel for schedule(dynamic) \
-	num_threads(THREADS)
-	for(i = 0; i < THREADS; ++i)
+	num_threads(nthreads)
+	for(i = 0; i < nthreads; ++i)
 	{
-		fseek(fp[i], i * (unsigned long) (sz / THREADS), SEEK_SET);			
+		fseek(fp[i], (long)(i * (sz / nthreads)), SEEK_SET);
 	}
 
 	if(memory)
@@ -150,30 +222,42 @@ main(int argc, char** argv)
 			 * Read file from disk in parallel
 			 */
 			#pragma omp parallel for schedule(dynamic) \
-			num_threads(THREADS)
-			for(i = 0; i < THREADS; ++i) {
-				cur[i] = memory_encode_read_file(fp[i], &buf[i], (unsigned long) (sz / THREADS));
+			num_threads(nthreads)
+			for(i = 0; i < nthreads; ++i) {
+				/* The last thread also reads what is left over. */
+				uint64_t size = i == nthreads - 1 ?
+					sz - i * (sz / nthreads) : sz / nthreads;
+				cur[i] = memory_encode_read_file(fp[i], &buf[i], size);
+				if(cur[i] != size)
+					cur[i] = (size_t)-1;
+			}
+
+			for(i = 0; i < nthreads; ++i) {
+				if(cur[i] == (size_t)-1)
+				{
+					fprintf(stderr, "Can't read input file '%s'\n", file_in);
+					return 1;
+				}
 			}
 
 			// Allocate the new full buffer
-			int newSize = 0;
-			for(i = 0; i < THREADS; ++i) {
-				newSize += strlen(buf[i]);
+			size_t newSize = 0, pos = 0;
+			for(i = 0; i < nthreads; ++i) {
+				newSize += cur[i];
 			}
 
 			/**
 			 * Copy the contents of all 
 			 * partial buffers into one
 			 */
-			char *scarlat = malloc(newSize * sizeof(char));
+			unsigned char *scarlat = malloc(newSize ? newSize : 1);
 
-			strcpy(scarlat, buf[0]);
-			
-			for (i = 1; i < THREADS; ++i) {
-				strcat(scarlat, buf[i]);
+			for (i = 0; i < nthreads; ++i) {
+				memcpy(scarlat + pos, buf[i], cur[i]);
+				pos += cur[i];
 			}
 
-			// for (i = 0; i < THREADS; ++i) {
+			// for (i = 0; i < nthreads; ++i) {
 			// 	free(buf[i]);
 			// 	buf[i] = NULL;
 			// }
@@ -183,7 +267,7 @@ main(int argc, char** argv)
 			 * TODO - add 1 thread to write to memory the table
 			 *		- add 4 threads to write to memory their segments of content
 			 */
-			if(huffman_encode_memory(scarlat, newSize, &bufout, &bufoutlen))
+			if(huffman_encode_memory64_ex(scarlat, newSize, &bufout, &bufoutlen, &params))
 			{
 				free(scarlat);
 				return 1;
@@ -192,7 +276,7 @@ main(int argc, char** argv)
 			free(scarlat);
 
 			/* Write the memory to the file. */
-			if(fwrite(bufout, 1, bufoutlen, out) != bufoutlen)
+			if(fwrite(bufout, 1, (size_t)bufoutlen, out) != bufoutlen)
 			{
 				free(bufout);
 				return 1;
@@ -201,37 +285,47 @@ main(int argc, char** argv)
 			free(bufout);
 		}
 		else {
-			int a, pos = 0;
-			unsigned long size = sz / THREADS;
+			size_t pos = 0;
 
 			#pragma omp parallel for schedule(dynamic) \
-			num_threads(THREADS)
-			for(i = 0; i < THREADS; ++i) {
-				if (i == THREADS - 1) {
-					size = sz - (THREADS - 1) * size;
-				}
+			num_threads(nthreads)
+			for(i = 0; i < nthreads; ++i) {
+				/* The last thread also reads what is left over. */
+				uint64_t size = i == nthreads - 1 ?
+					sz - i * (sz / nthreads) : sz / nthreads;
 				cur[i] = memory_decode_read_file(fp[i], &buf[i], size);
+				if(cur[i] != size)
+					cur[i] = (size_t)-1;
+			}
+
+			for(i = 0; i < nthreads; ++i) {
+				if(cur[i] == (size_t)-1)
+				{
+					fprintf(stderr, "Can't read input file '%s'\n", file_in);
+					return 1;
+				}
 			}
 
-			unsigned int sum = 0;
-			for(i = 0; i < THREADS; i++) {
+			uint64_t sum = 0;
+			for(i = 0; i < nthreads; i++) {
 				sum += cur[i];
 			}
 
-			char *scarlat = malloc(sum * sizeof(char));
+			unsigned char *scarlat = malloc(sum ? (size_t)sum : 1);
 
-			for (i = 0; i <	THREADS; ++i) {
+			for (i = 0; i <	nthreads; ++i) {
 				memcpy(scarlat + pos, buf[i], cur[i]);
 				pos += cur[i];
 			}
 
-			// for (i = 0; i < THREADS; i++) {
+			// for (i = 0; i < nthreads; i++) {
 			// 	free(buf[i]);
 			// 	buf[i] = NULL;
 			// }
 
 			/* Decode the memory. */
-			if(huffman_decode_memory(scarlat, sum, &bufout, &bufoutlen))
+			if(huffman_decode_memory64_ex(scarlat, sum, &bufout, &bufoutlen,
+										  &params))
 			{
 				free(scarlat);
 				return 1;
@@ -240,7 +334,7 @@ main(int argc, char** argv)
 			free(scarlat);
 
 			// Write the memory to the file. 
-			if(fwrite(bufout, 1, bufoutlen, out) != bufoutlen)
+			if(fwrite(bufout, 1, (size_t)bufoutlen, out) != bufoutlen)
 			{
 				free(bufout);
 				return 1;
@@ -253,75 +347,30 @@ main(int argc, char** argv)
 }
 }
 
-static unsigned int
+static size_t
 memory_encode_read_file(FILE *in,
-				   unsigned char **buf, unsigned long sz)
+				   unsigned char **buf, uint64_t sz)
 {
-	unsigned int i, len = 0, cur = 0, inc = 1024;
-
 	assert(in);
 
-	/* Read the file into memory. */
-	for(i = 0; i < (unsigned int)sz; i += inc)
-	{
-		//printf("%d\n", omp_get_thread_num());
-		unsigned char *tmp;
-		len += inc;
-		tmp = (unsigned char*)realloc(*buf, len);
-		if(!tmp)
-		{
-			if(*buf)
-				free(buf);
-			return -1;
-		}
-
-		*buf = tmp;
-		if(cur + inc > sz) {
-			cur += fread(*buf + cur, 1, (unsigned int)(sz - cur), in);
-		} 
-		else {
-			cur += fread(*buf + cur, 1, inc, in);
-		}
-	}
+	/* Read the piece into memory, allocated once at its size. */
+	*buf = (unsigned char*)malloc(sz ? (size_t)sz : 1);
+	if(!*buf)
+		return (size_t)-1;
 
-	if(NULL != *buf) {
-		return cur;
-	}
-	return -1;
+	return fread(*buf, 1, (size_t)sz, in);
 }
 
-static unsigned int
+static size_t
 memory_decode_read_file(FILE *in,
-				   unsigned char **buf, unsigned long sz)
+				   unsigned char **buf, uint64_t sz)
 {
-	unsigned int i, len = 0, cur = 0, inc = 1024;
 	assert(in);
 
-	/* Read the file into memory. */
-	for (i = 0; i < (unsigned int)sz; i+=inc)
-	{
-		unsigned char *tmp;
-		len += inc;
-		tmp = (unsigned char*)realloc(*buf, len);
-		if(!tmp)
-		{
-			if(*buf) {
-				free(*buf);
-			}
-			return 1;
-		}
-
-		*buf = tmp;
-		if(cur + inc > sz) {
-			cur += fread(*buf + cur, 1, (unsigned int)(sz - cur), in);
-		} 
-		else {
-			cur += fread(*buf + cur, 1, inc, in);
-		}
-	}
+	/* Read the piece into memory, allocated once at its size. */
+	*buf = (unsigned char*)malloc(sz ? (size_t)sz : 1);
+	if(!*buf)
+		return (size_t)-1;
 
-	if(NULL != *buf) {
-		return cur;
-	}
-	return -1;
+	return fread(*buf, 1, (size_t)sz, in);
 }
@@ -20,70 +20,54 @@ extern char* optarg;
 #include <unistd.h>
 #endif
 
-#define THREADS 4
+static size_t memory_encode_read_file(FILE *in,
+									   unsigned char **buf, uint64_t sz);
+static size_t memory_decode_read_file(FILE *in,
+									   unsigned char **buf, uint64_t sz);
 
-static unsigned int memory_encode_read_file(FILE *in,
-									   unsigned char **buf, unsigned long sz);
-static unsigned int memory_decode_read_file(FILE *in,
-									   unsigned char **buf, unsigned long sz);
-
-struct open_files
+/*
+ * read_struct describes the piece of the input file that one
+ * thread reads into memory with its own file pointer.
+ */
+struct read_struct
 {
-  FILE *fp;
-  char *file_in;
+	const char *file_in;
+	uint64_t sz;
+	unsigned int nthreads;
+	char compress;
+	unsigned char *buf;
+	size_t cur;
 };
 
-struct fseek_files
+/*
+ * thread_read_file opens the input file, seeks to piece i and reads
+ * it. The last piece also takes what is left over.
+ */
+static int
+thread_read_file(void *arguments, uint64_t i)
 {
-  FILE *fp;
-  unsigned long sz;
-  unsigned int pos;
-};
+	struct read_struct *args = &((struct read_struct *)arguments)[i];
+	uint64_t size = args->sz / args->nthreads;
+	FILE *fp;
 
-struct code_struct
-{
-  FILE *fp;
-  unsigned int sz;
-  unsigned char **buf;
-  unsigned int cur;
+	if(i == args->nthreads - 1)
+		size = args->sz - i * size;
 
-};
-
-void *thread_open_file(void *arguments)
-{
-	unsigned int i;
-	struct open_files *args = (struct open_files *)arguments;
-	args -> fp = fopen(args -> file_in, "rb");
-	if( !(args -> fp) )
+	fp = fopen(args->file_in, "rb");
+	if(!fp)
 	{
 		fprintf(stderr,
 				"Can't open input file '%s': %s\n",
-				args -> file_in, strerror(errno));
-		exit(1);
+				args->file_in, strerror(errno));
+		return 1;
 	}
-}
 
-void *thread_fseek_file(void *arguments)
-{
-
-	struct fseek_files *args = (struct fseek_files *)arguments;	
-
-	fseek(args -> fp, args -> pos * (unsigned long) (args -> sz / THREADS), SEEK_SET);
-}
-
-void *thread_encode_file(void *arguments)
-{
-	struct code_struct *args = (struct code_struct *)arguments;
-	
-	args -> cur = memory_encode_read_file(args -> fp, args -> buf,
-				  (unsigned long) (args -> sz / THREADS));
-}
-
-void *thread_decode_file(void *arguments)
-{
-	struct code_struct *args = (struct code_struct *)arguments;
-
-	args -> cur = memory_decode_read_file(args -> fp, args -> buf, args -> sz);
+	fseek(fp, (long)(i * (args->sz / args->nthreads)), SEEK_SET);
+	args->cur = args->compress ?
+		memory_encode_read_file(fp, &args->buf, size) :
+		memory_decode_read_file(fp, &args->buf, size);
+	fclose(fp);
+	return args->cur != size;
 }
 
 static void
@@ -98,11 +82,17 @@ version(FILE *out)
 static void
 usage(FILE* out)
 {
-	fputs("Usage: huffcode [-i<input file>] [-o<output file>] [-d|-c]\n"
+	fputs("Usage: huffcode [-i<input file>] [-o<output file>] [-d|-c]"
+		  " [-b<bits>] [-s<streams>] [-j<threads>] [-x]\n"
 		  "-i - input file (default is standard input)\n"
 		  "-o - output file (default is standard output)\n"
 		  "-d - decompress\n"
 		  "-c - compress (default)\n"
+		  "-b - longest code in bits when compressing (default 32)\n"
+		  "-s - bitstreams per block when compressing, for faster decoding"
+		  " (default 1)\n"
+		  "-j - threads to use (default is the number of CPUs available)\n"
+		  "-x - index the blocks when compressing, for parallel decoding\n"
 		  "-m - read file into memory, compress, then write to file (not default)\n",
 		  out);
 }
@@ -110,29 +100,24 @@ usage(FILE* out)
 int
 main(int argc, char** argv)
 {
-	unsigned char *buf[THREADS];
-	char memory = 1;
+	char memory = 0;
 	char compress = 1;
 	int opt;
-	unsigned int i;
+	unsigned int i, nthreads;
     char *file_in = NULL, *file_out = NULL;
 	
 	unsigned char* bufout = NULL;
-	unsigned int bufoutlen = 0;
+	uint64_t bufoutlen = 0;
 
-	for (i = 0; i < THREADS; ++i)
-		buf[i] = NULL;
-
-	struct open_files arguments_1[THREADS];
-	struct fseek_files arguments_2[THREADS];
-	struct code_struct arguments_3[THREADS];
-
-	pthread_t threads[THREADS] = {0};
+	struct read_struct *pieces;
 	
-	FILE *out = stdout;
+	FILE *in = stdin, *out = stdout;
+	huffman_params params;
+
+	huffman_params_init(&params);
 
 	/* Get the command line arguments. */
-	while((opt = getopt(argc, argv, "i:o:cdhvm")) != -1)
+	while((opt = getopt(argc, argv, "i:o:cdhvmb:s:j:x")) != -1)
 	{
 		switch(opt)
 		{
@@ -148,6 +133,39 @@ main(int argc, char** argv)
 		case 'd':
 			compress = 0;
 			break;
+		case 'm':
+			memory = 1;
+			break;
+		case 'x':
+			params.block_index = 1;
+			break;
+		case 'b':
+			params.max_bits = (unsigned int)atoi(optarg);
+			if(params.max_bits < 1 || params.max_bits > HUFFMAN_MAX_CODE_BITS)
+			{
+				fprintf(stderr, "Code length must be from 1 to %d bits\n",
+						HUFFMAN_MAX_CODE_BITS);
+				return 1;
+			}
+			break;
+		case 's':
+			params.streams = (unsigned int)atoi(optarg);
+			if(params.streams < 1 || params.streams > HUFFMAN_MAX_STREAMS)
+			{
+				fprintf(stderr, "Streams must be from 1 to %d\n",
+						HUFFMAN_MAX_STREAMS);
+				return 1;
+			}
+			break;
+		case 'j':
+			params.threads = (unsigned int)atoi(optarg);
+			if(params.threads < 1 || params.threads > HUFFMAN_MAX_THREADS)
+			{
+				fprintf(stderr, "Threads must be from 1 to %d\n",
+						HUFFMAN_MAX_THREADS);
+				return 1;
+			}
+			break;
 		case 'h':
 			usage(stdout);
 			return 0;
@@ -160,30 +178,17 @@ main(int argc, char** argv)
 		}
 	}
 
-	FILE *fp[THREADS];
-
-	/* If an input file is given then open it
-	 * on several positions
-	 */
+	/* If an input file is given then open it. */
 	if(file_in)
 	{
-		for(i = 0; i < THREADS; ++i) {
-			arguments_1[i].fp = fp[i];
-			arguments_1[i].file_in = file_in;
-
-			if ( pthread_create(&threads[i], NULL, thread_open_file, (void *)&arguments_1[i]) ) {
-	         fprintf(stderr, "Error creating threads\n");
-	         return -1;
-	        }
-	    }
-
-	    for(i = 0; i < THREADS; i++) {
-	        // wait for the threads to finish the initialisation
-	        if ( pthread_join(threads[i], NULL) ) {
-	          fprintf(stderr, "Error joining threads\n");
-	          return -1;
-	        }
-	    }
+		in = fopen(file_in, "rb");
+		if(!in)
+		{
+			fprintf(stderr,
+					"Can't open input file '%s': %s\n",
+					file_in, strerror(errno));
+			return 1;
+		}
 	}
 
 	/* If an output file is given then create it. */
@@ -199,233 +204,122 @@ main(int argc, char** argv)
 		}
 	}
 
+	/**
+	 * Unless the file is to be read into memory, stream
+	 * it through the library one block at a time
+	 */
+	if(!memory)
+	{
+		return compress ?
+			huffman_encode_file_ex(in, out, &params) :
+			huffman_decode_file_ex(in, out, &params);
+	}
+
+	/* The pieces of the file are read with a file pointer each. */
+	if(!file_in)
+	{
+		fprintf(stderr, "Reading into memory needs an input file\n");
+		return 1;
+	}
+
 	/**
 	 * Get file size
 	 */
-	fseek(arguments_1[0].fp, 0L, SEEK_END);
-	unsigned long sz = (unsigned long)ftell(arguments_1[0].fp);
-	fseek(arguments_1[0].fp, 0L, SEEK_SET);
+	fseek(in, 0L, SEEK_END);
+	uint64_t sz = (uint64_t)ftell(in);
+	fclose(in);
 
 	/**
-	 * Increment each file pointer to its specific chunk size
+	 * Read the file from disk in parallel, on as many
+	 * threads as it is coded on
 	 */
-	for(i = 0; i < THREADS; ++i)
+	nthreads = params.threads;
+	pieces = calloc(nthreads, sizeof(*pieces));
+	if(!pieces)
 	{
-		arguments_2[i].fp = arguments_1[i].fp;
-		arguments_2[i].sz = sz;
-		arguments_2[i].pos = i;
-		
-		if ( pthread_create(&threads[i], NULL, thread_fseek_file, (void *)&arguments_2[i]) ) {
-	         fprintf(stderr, "Error creating threads\n");
-	         return -1;
-	    }
+		fprintf(stderr, "Out of memory\n");
+		return 1;
 	}
 
-	for(i = 0; i < THREADS; ++i)
+	for(i = 0; i < nthreads; ++i)
 	{
-		if ( pthread_join(threads[i], NULL) ) {
-	          fprintf(stderr, "Error joining threads\n");
-	          return -1;
-	    }
+		pieces[i].file_in = file_in;
+		pieces[i].sz = sz;
+		pieces[i].nthreads = nthreads;
+		pieces[i].compress = compress;
 	}
 
-	if(memory)
-	{
-		if (compress) {
-			/**
-			 * Read file from disk in parallel
-			 */
-			for(i = 0; i < THREADS; ++i) {
-
-				arguments_3[i].fp = arguments_1[i].fp;
-				arguments_3[i].sz = sz;
-				arguments_3[i].buf = &buf[i];
-				
-				if ( pthread_create(&threads[i], NULL, thread_encode_file, (void *)&arguments_3[i]) ) {
-	         		fprintf(stderr, "Error creating threads\n");
-	         		return -1;
-	        	}
-			}
-
-			for(i = 0; i < THREADS; ++i) {
-				if ( pthread_join(threads[i], NULL) ) {
-	          		fprintf(stderr, "Error joining threads\n");
-	          		return -1;
-	    		}
-			}
-
-			// Allocate the new full buffer
-			int newSize = 0;
-			for(i = 0; i < THREADS; ++i) {
-				newSize += strlen(buf[i]);
-			}
-
-			/**
-			 * Copy the contents of all 
-			 * partial buffers into one
-			 */
-			char *text = malloc(newSize * sizeof(char));
-
-			strcpy(text, buf[0]);
-			
-			for (i = 1; i < THREADS; ++i) {
-				strcat(text, buf[i]);
-			}
+	if(huffman_run_parallel(nthreads, nthreads, thread_read_file, pieces))
+		return 1;
 
-			/**
-			 * Do actual huffman algorithm
-			 * TODO - add 1 thread to write to memory the table
-			 *		- add 4 threads to write to memory their segments of content
-			 */
-			if(huffman_encode_memory(text, newSize, &bufout, &bufoutlen))
-			{
-				free(text);
-				return 1;
-			}
-
-			free(text);
-
-			/* Write the memory to the file. */
-			if(fwrite(bufout, 1, bufoutlen, out) != bufoutlen)
-			{
-				free(bufout);
-				return 1;
-			}
-
-			free(bufout);
-		}
-		else {
-			int a, pos = 0;
-			unsigned long size = sz / THREADS;
-
-			for(i = 0; i < THREADS; ++i) {
-
-				arguments_3[i].fp = arguments_1[i].fp;
-				arguments_3[i].buf = &buf[i];
-
-				if (i == THREADS - 1) {
-					arguments_3[i].sz = sz - (THREADS - 1) * size;
-				}
-				else {
-					arguments_3[i].sz = size;
-				}
-			
-				if ( pthread_create(&threads[i], NULL, thread_decode_file, (void *)&arguments_3[i]) ) {
-	         		fprintf(stderr, "Error creating threads\n");
-	         		return -1;
-	        	}
-			}
-
-			for(i = 0; i < THREADS; ++i) {
-				if ( pthread_join(threads[i], NULL) ) {
-	          		fprintf(stderr, "Error joining threads\n");
-	          		return -1;
-	    		}
-			}
-
-			unsigned int sum = 0;
-			for(i = 0; i < THREADS; i++) {
-				sum += arguments_3[i].cur;
-			}
-
-			char *text = malloc(sum * sizeof(char));
+	/**
+	 * Copy the contents of all
+	 * partial buffers into one
+	 */
+	size_t newSize = 0, pos = 0;
+	for(i = 0; i < nthreads; ++i) {
+		newSize += pieces[i].cur;
+	}
 
-			for (i = 0; i <	THREADS; ++i) {
-				memcpy(text + pos, buf[i], arguments_3[i].cur);
-				pos += arguments_3[i].cur;
-			}
+	unsigned char *text = malloc(newSize ? newSize : 1);
+	if(!text)
+		return 1;
 
-			/* Decode the memory. */
-			if(huffman_decode_memory(text, sum, &bufout, &bufoutlen))
-			{
-				free(text);
-				return 1;
-			}
+	for (i = 0; i < nthreads; ++i) {
+		memcpy(text + pos, pieces[i].buf, pieces[i].cur);
+		pos += pieces[i].cur;
+		free(pieces[i].buf);
+	}
+	free(pieces);
 
-			free(text);
+	/**
+	 * Do actual huffman algorithm
+	 */
+	if(compress ?
+	   huffman_encode_memory64_ex(text, newSize, &bufout, &bufoutlen, &params) :
+	   huffman_decode_memory64_ex(text, newSize, &bufout, &bufoutlen, &params))
+	{
+		free(text);
+		return 1;
+	}
 
-			// Write the memory to the file. 
-			if(fwrite(bufout, 1, bufoutlen, out) != bufoutlen)
-			{
-				free(bufout);
-				return 1;
-			}
+	free(text);
 
-			free(bufout);
-		}
+	/* Write the memory to the file. */
+	if(fwrite(bufout, 1, (size_t)bufoutlen, out) != bufoutlen)
+	{
+		free(bufout);
+		return 1;
+	}
 
-		return 0;
-}
+	free(bufout);
+	return 0;
 }
 
-static unsigned int
+static size_t
 memory_encode_read_file(FILE *in,
-				   unsigned char **buf, unsigned long sz)
+				   unsigned char **buf, uint64_t sz)
 {
-	unsigned int i, len = 0, cur = 0, inc = 1024;
-
 	assert(in);
 
-	/* Read the file into memory. */
-	for(i = 0; i < (unsigned int)sz; i += inc)
-	{
-		unsigned char *tmp;
-		len += inc;
-		tmp = (unsigned char*)realloc(*buf, len);
-		if(!tmp)
-		{
-			if(*buf)
-				free(buf);
-			return -1;
-		}
-
-		*buf = tmp;
-		if(cur + inc > sz) {
-			cur += fread(*buf + cur, 1, (unsigned int)(sz - cur), in);
-		} 
-		else {
-			cur += fread(*buf + cur, 1, inc, in);
-		}
-	}
+	/* Read the piece into memory, allocated once at its size. */
+	*buf = (unsigned char*)malloc(sz ? (size_t)sz : 1);
+	if(!*buf)
+		return (size_t)-1;
 
-	if(NULL != *buf) {
-		return cur;
-	}
-	return -1;
+	return fread(*buf, 1, (size_t)sz, in);
 }
 
-static unsigned int
+static size_t
 memory_decode_read_file(FILE *in,
-				   unsigned char **buf, unsigned long sz)
+				   unsigned char **buf, uint64_t sz)
 {
-	unsigned int i, len = 0, cur = 0, inc = 1024;
 	assert(in);
 
-	/* Read the file into memory. */
-	for (i = 0; i < (unsigned int)sz; i+=inc)
-	{
-		unsigned char *tmp;
-		len += inc;
-		tmp = (unsigned char*)realloc(*buf, len);
-		if(!tmp)
-		{
-			if(*buf) {
-				free(*buf);
-			}
-			return 1;
-		}
-
-		*buf = tmp;
-		if(cur + inc > sz) {
-			cur += fread(*buf + cur, 1, (unsigned int)(sz - cur), in);
-		} 
-		else {
-			cur += fread(*buf + cur, 1, inc, in);
-		}
-	}
+	/* Read the piece into memory, allocated once at its size. */
+	*buf = (unsigned char*)malloc(sz ? (size_t)sz : 1);
+	if(!*buf)
+		return (size_t)-1;
 
-	if(NULL != *buf) {
-		return cur;
-	}
-	return -1;
+	return fread(*buf, 1, (size_t)sz, in);
 }
@@ -4,6 +4,10 @@
  *  Copyright (C) 2003  Douglas Ryan Richardson
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,247 +17,378 @@
 
 #ifdef WIN32
 #include <winsock2.h>
-#include <malloc.h>
-#define alloca _alloca
 #else
 #include <netinet/in.h>
+#include <unistd.h>
 #endif
 
-#define CACHE_SIZE 1024
-#define CORES 4
+#ifdef __linux__
+#include <sched.h>
+#endif
 
-typedef struct huffman_node_tag
+/* huffman_encode_memory64_ex counts and encodes its input in chunks
+   of TASK_SIZE bytes, the last of which may be shorter. The chunks
+   are handed out to the threads one at a time, so a thread that is
+   held up only delays the chunk it is on. */
+#define TASK_SIZE (1u << 18)
+
+/*
+ * The threads the library codes with are started the first time
+ * they are needed and kept for the life of the process, so every
+ * call and every phase of a call shares them. Work is handed to
+ * them as jobs on a queue. A job is a function to be called for
+ * each index from 0 to n - 1 on at most limit threads at once. The
+ * thread that queues a job takes indices from it as well, so a job
+ * is finished even if no worker could be started.
+ */
+typedef struct pool_job_tag
 {
-	unsigned char isLeaf;
-	unsigned long count;
-	struct huffman_node_tag *parent;
+	int (*func)(void *arg, uint64_t i);
+	void *arg;
+	uint64_t n;
 
-	union
-	{
-		struct
-		{
-			struct huffman_node_tag *zero, *one;
-		};
-		unsigned char symbol;
-	};
-} huffman_node;
+	/* The next index to hand out. */
+	uint64_t next;
 
-typedef struct huffman_code_tag
-{
-	/* The length of this code in bits. */
-	unsigned long numbits;
+	/* The calls that have not returned yet. */
+	uint64_t remaining;
 
-	/* The bits that make up this code. The first
-	   bit is at position 0 in bits[0]. The second
-	   bit is at position 1 in bits[0]. The eighth
-	   bit is at position 7 in bits[0]. The ninth
-	   bit is at position 0 in bits[1]. */
-	unsigned char *bits;
-} huffman_code;
+	/* The threads calling func now, and how many may. */
+	unsigned int busy;
+	unsigned int limit;
 
-#define MAX_SYMBOLS 256
-typedef huffman_node* SymbolFrequencies[MAX_SYMBOLS];
-typedef huffman_code* SymbolEncoder[MAX_SYMBOLS];
+	/* The OR of the values func returned. */
+	int rc;
 
-typedef struct buf_cache_tag
+	struct pool_job_tag *link;
+} pool_job;
+
+static struct
 {
-	unsigned char *cache;
-	unsigned int cache_len;
-	unsigned int cache_cur;
-	unsigned char **pbufout;
-	unsigned int *pbufoutlen;
-} buf_cache;
+	pthread_mutex_t lock;
 
-int flush_cache(buf_cache* pc);
+	/* Signalled when a job is queued. */
+	pthread_cond_t work;
 
-static int
-do_memory_encode(buf_cache *pc, const unsigned char* bufin,
-				 unsigned int bufinlen, SymbolEncoder *se);
+	/* Broadcast when a call returns. */
+	pthread_cond_t done;
 
-int init_cache(buf_cache* pc, unsigned int cache_size,
-			   unsigned char **pbufout, unsigned int *pbufoutlen);
- 
-struct cache_struct
-{
-  unsigned char **_bufout;
-  unsigned int *_bufoutlen;
-  buf_cache *cache_tid;
-};
+	/* The jobs that have indices left to hand out. */
+	pool_job *head;
+	pool_job *tail;
 
-struct block_encode_struct
-{
-  const unsigned char **bufin;
-  unsigned int *bufinlen;
-  buf_cache *cache_tid;
-  unsigned int pos;
-  unsigned int remains;
-  SymbolEncoder **se;
+	unsigned int nworkers;
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	NULL, NULL, 0
 };
 
-void *init_cache_for_threads(void *arguments)
+/*
+ * pool_take hands out the next index of job, taking the job off the
+ * queue once it has none left. pool.lock must be held.
+ */
+static uint64_t
+pool_take(pool_job *job)
 {
-	struct cache_struct *args = (struct cache_struct *)arguments;
+	uint64_t i = job->next++;
+	pool_job **p;
 
-	*(args -> _bufoutlen) = 0;
-	init_cache(args -> cache_tid, CACHE_SIZE, args -> _bufout, args -> _bufoutlen);
+	++job->busy;
+	if(job->next == job->n)
+	{
+		for(p = &pool.head; *p != job; p = &(*p)->link)
+			;
+		*p = job->link;
+		if(pool.tail == job)
+			pool.tail = NULL;
+		for(p = &pool.head; *p; p = &(*p)->link)
+			pool.tail = *p;
+	}
+
+	return i;
 }
 
-void *do_memory_encode_threads(void *arguments)
+/*
+ * pool_call makes the call for index i of job, with pool.lock held
+ * before and after but not during the call.
+ */
+static void
+pool_call(pool_job *job, uint64_t i)
 {
-	struct block_encode_struct *args = (struct block_encode_struct *)arguments;
+	int rc;
 
-	args -> remains = do_memory_encode(args -> cache_tid,
-					  *(args -> bufin) + (args -> pos * ( *(args -> bufinlen) ) / CORES),
-					  *(args -> bufinlen) / CORES, *(args -> se) );
-	flush_cache(args -> cache_tid);
-}
+	pthread_mutex_unlock(&pool.lock);
+	rc = job->func(job->arg, i);
+	pthread_mutex_lock(&pool.lock);
 
-static unsigned long
-numbytes_from_numbits(unsigned long numbits)
-{
-	return numbits / 8 + (numbits % 8 ? 1 : 0);
+	job->rc |= rc;
+	--job->busy;
+	--job->remaining;
+	pthread_cond_broadcast(&pool.done);
 }
 
-/*
- * get_bit returns the ith bit in the bits array
- * in the 0th position of the return value.
- */
-static unsigned char
-get_bit(unsigned char* bits, unsigned long i)
+static void *
+pool_worker(void *unused)
 {
-	return (bits[i / 8] >> i % 8) & 1;
+	pool_job *job;
+
+	(void)unused;
+	pthread_mutex_lock(&pool.lock);
+	for(;;)
+	{
+		for(job = pool.head; job && job->busy >= job->limit; job = job->link)
+			;
+		if(!job)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		else
+			pool_call(job, pool_take(job));
+	}
+
+	return NULL;
 }
 
-static void
-reverse_bits(unsigned char* bits, unsigned long numbits)
+int huffman_run_parallel(unsigned int threads,
+						 uint64_t n,
+						 int (*func)(void *arg, uint64_t i),
+						 void *arg)
 {
-	unsigned long numbytes = numbytes_from_numbits(numbits);
-	unsigned char *tmp =
-	    (unsigned char*)alloca(numbytes);
-	unsigned long curbit;
-	long curbyte = 0;
-	
-	memset(tmp, 0, numbytes);
+	pool_job job;
+	unsigned int want, k;
+	uint64_t i;
+	int rc = 0;
 
-	for(curbit = 0; curbit < numbits; ++curbit)
+	/* With a single thread there is nothing to hand out. */
+	if(threads <= 1 || n <= 1)
 	{
-		unsigned int bitpos = curbit % 8;
+		for(i = 0; i < n; ++i)
+			rc |= func(arg, i);
+		return rc;
+	}
+
+	if(threads > HUFFMAN_MAX_THREADS)
+		threads = HUFFMAN_MAX_THREADS;
+
+	job.func = func;
+	job.arg = arg;
+	job.n = n;
+	job.next = 0;
+	job.remaining = n;
+	job.busy = 0;
+	job.limit = threads;
+	job.rc = 0;
+	job.link = NULL;
+
+	/* The calling thread is one of the threads, so the job needs
+	   one worker less than it may use. */
+	want = (uint64_t)threads < n ? threads - 1 : (unsigned int)n - 1;
+
+	pthread_mutex_lock(&pool.lock);
+	while(pool.nworkers < want)
+	{
+		pthread_t thread;
+
+		if(pthread_create(&thread, NULL, pool_worker, NULL))
+			break;
+		pthread_detach(thread);
+		++pool.nworkers;
+	}
+
+	if(pool.tail)
+		pool.tail->link = &job;
+	else
+		pool.head = &job;
+	pool.tail = &job;
+	for(k = 0; k < want; ++k)
+		pthread_cond_signal(&pool.work);
 
-		if(curbit > 0 && curbit % 8 == 0)
-			++curbyte;
-		
-		tmp[curbyte] |= (get_bit(bits, numbits - curbit - 1) << bitpos);
+	while(job.remaining > 0)
+	{
+		if(job.next < job.n && job.busy < job.limit)
+			pool_call(&job, pool_take(&job));
+		else
+			pthread_cond_wait(&pool.done, &pool.lock);
 	}
+	pthread_mutex_unlock(&pool.lock);
 
-	memcpy(bits, tmp, numbytes);
+	return job.rc;
 }
 
+typedef struct huffman_node_tag
+{
+	uint64_t count;
+
+	/* The two subsets of a set, as indexes into the nodes
+	   of its huffman_tree. Both are NO_NODE for a leaf. */
+	uint16_t zero, one;
+	unsigned char symbol;
+} huffman_node;
+
+#define MAX_SYMBOLS 256
+
+/* The longest code the decoder's bit buffer is guaranteed to hold. */
+#define MAX_CODE_BITS 56
+
 /*
- * new_code builds a huffman_code from a leaf in
- * a Huffman tree.
+ * The first byte of the encoded memory is the format version. The
+ * legacy format starts with the number of code table entries as a
+ * 32-bit big endian value, so its first byte is always 0.
  */
-static huffman_code*
-new_code(const huffman_node* leaf)
-{
-	/* Build the huffman code by walking up to
-	 * the root node and then reversing the bits,
-	 * since the Huffman code is calculated by
-	 * walking down the tree. */
-	unsigned long numbits = 0;
-	unsigned char* bits = NULL;
-	huffman_code *p;
+#define HUFFMAN_FORMAT_LEGACY 0
+#define HUFFMAN_FORMAT_V1 1
 
-	while(leaf && leaf->parent)
-	{
-		huffman_node *parent = leaf->parent;
-		unsigned char cur_bit = (unsigned char)(numbits % 8);
-		unsigned long cur_byte = numbits / 8;
+/*
+ * A stream of independently coded blocks, as written by
+ * huffman_encode_file. After the version byte, each block is
+ * its length as a 32-bit big endian value followed by a V1
+ * image of up to HUFFMAN_MAX_BLOCK_SIZE bytes of input. A
+ * length of 0 ends the stream.
+ */
+#define HUFFMAN_FORMAT_BLOCKS 2
 
-		/* If we need another byte to hold the code,
-		   then allocate it. */
-		if(cur_bit == 0)
-		{
-			size_t newSize = cur_byte + 1;
-			bits = (unsigned char*)realloc(bits, newSize);
-			bits[newSize - 1] = 0; /* Initialize the new byte. */
-		}
+/*
+ * V1 with the number of bytes encoded stored as a 64-bit big
+ * endian value. It is only written when the count does not fit
+ * in 32 bits, so smaller inputs still produce V1.
+ */
+#define HUFFMAN_FORMAT_V2 3
 
-		/* If a one must be added then or it in. If a zero
-		 * must be added then do nothing, since the byte
-		 * was initialized to zero. */
-		if(leaf == parent->one)
-			bits[cur_byte] |= 1 << cur_bit;
+/*
+ * A HUFFMAN_FORMAT_BLOCKS stream may carry an index of its blocks
+ * after the block of length 0. For every block it holds the offset
+ * of the block's length in the stream and the offset of its first
+ * byte in the decoded data. The decoded length, the number of
+ * blocks and INDEX_MAGIC follow. The numbers are 64-bit big endian.
+ * Readers that stop at the block of length 0 never see the index.
+ */
+#define INDEX_MAGIC "HIDX"
+#define INDEX_ENTRY_SIZE 16
+#define INDEX_TRAILER_SIZE 20
 
-		++numbits;
-		leaf = parent;
-	}
+/* Header flags. */
+#define HUFFMAN_FLAG_NIBBLES 0x01
+
+/*
+ * The data is split into several bitstreams. The code lengths are
+ * followed by the number of streams in a byte and the length in
+ * bytes of every stream but the last as a 64-bit big endian value.
+ * Symbol i is coded in stream i % streams, and the streams follow
+ * each other, each starting on a byte boundary.
+ */
+#define HUFFMAN_FLAG_STREAMS 0x02
 
-	if(bits)
-		reverse_bits(bits, numbits);
+/* The header is at most 12 bytes, a byte per symbol
+   and the stream lengths. */
+#define MAX_HEADER_SIZE \
+	(12 + MAX_SYMBOLS + 1 + 8 * (HUFFMAN_MAX_STREAMS - 1))
 
-	p = (huffman_code*)malloc(sizeof(huffman_code));
-	p->numbits = numbits;
-	p->bits = bits;
-	return p;
-}
+/* The longest block image: the header, the longest code for
+   every byte of the largest block and the partly used last byte
+   of every stream. */
+#define MAX_BLOCK_IMAGE_SIZE \
+	(MAX_HEADER_SIZE + HUFFMAN_MAX_BLOCK_SIZE / 8 * HUFFMAN_MAX_CODE_BITS + \
+	 HUFFMAN_MAX_STREAMS)
+
+typedef uint64_t SymbolFrequencies[MAX_SYMBOLS];
 
-static huffman_node*
-new_leaf_node(unsigned char symbol)
+/* A tree with a leaf for each of n symbols has 2n - 1 nodes. */
+#define MAX_NODES (2 * MAX_SYMBOLS - 1)
+
+/* The index of a subset that is not there. */
+#define NO_NODE 0xffff
+
+/*
+ * huffman_tree holds every node of a Huffman tree in one array,
+ * linked by index. The leaves come first, sorted by count, and
+ * are followed by the sets in the order they are merged, so a
+ * set always comes after its subsets and the root is last.
+ */
+typedef struct huffman_tree_tag
 {
-	huffman_node *p = (huffman_node*)malloc(sizeof(huffman_node));
-	p->isLeaf = 1;
-	p->symbol = symbol;
-	p->count = 0;
-	p->parent = 0;
-	return p;
-}
+	huffman_node nodes[MAX_NODES];
+	unsigned int nleaves;
+	unsigned int nnodes;
+} huffman_tree;
 
-static huffman_node*
-new_nonleaf_node(unsigned long count, huffman_node *zero, huffman_node *one)
+/*
+ * SymbolEncoder holds the code of every symbol in flat
+ * tables indexed by symbol value. A symbol that does not
+ * occur has a length of 0.
+ */
+typedef struct symbol_encoder_tag
 {
-	huffman_node *p = (huffman_node*)malloc(sizeof(huffman_node));
-	p->isLeaf = 0;
-	p->count = count;
-	p->zero = zero;
-	p->one = one;
-	p->parent = 0;
-	
-	return p;
-}
+	/* The bits that make up each code, shifted so that
+	   the first bit to be written is at position 0. */
+	uint32_t code[MAX_SYMBOLS];
 
-static void
-free_huffman_tree(huffman_node *subtree)
+	/* The length of each code in bits. */
+	unsigned char len[MAX_SYMBOLS];
+} SymbolEncoder;
+
+static unsigned char
+encode_chunk_at(unsigned char *data, uint64_t begin, uint64_t end,
+				const unsigned char *bufin, uint64_t count,
+				SymbolEncoder *se);
+
+struct block_encode_struct
 {
-	if(subtree == NULL)
-		return;
+	const unsigned char *bufin;
+	uint64_t bufinlen;
+	unsigned char *data;
+	const uint64_t *offsets;
+	unsigned char *tails;
+	SymbolEncoder *se;
+};
 
-	if(!subtree->isLeaf)
-	{
-		free_huffman_tree(subtree->zero);
-		free_huffman_tree(subtree->one);
-	}
-	
-	free(subtree);
+struct blocks_encode_struct
+{
+	const unsigned char *bufin;
+	uint64_t bufinlen;
+	unsigned int block_size;
+	unsigned char **images;
+	uint64_t *imagelens;
+	const huffman_params *params;
+};
+
+/**
+ * Every chunk is encoded straight into the output, at the bit the
+ * chunks before it end at.
+ */
+static int
+do_memory_encode_threads(void *arguments, uint64_t i)
+{
+	struct block_encode_struct *args = (struct block_encode_struct *)arguments;
+	uint64_t start = i * TASK_SIZE;
+	uint64_t end = args->bufinlen - start < TASK_SIZE ?
+		args->bufinlen : start + TASK_SIZE;
+
+	args->tails[i] = encode_chunk_at(args->data, args->offsets[i],
+									 args->offsets[i + 1],
+									 args->bufin + start, end - start,
+									 args->se);
+	return 0;
 }
 
-static void
-free_code(huffman_code* p)
+static unsigned long
+numbytes_from_numbits(unsigned long numbits)
+{
+	return numbits / 8 + (numbits % 8 ? 1 : 0);
+}
+
+/*
+ * get_bit returns the ith bit in the bits array
+ * in the 0th position of the return value.
+ */
+static unsigned char
+get_bit(unsigned char* bits, unsigned long i)
 {
-	free(p->bits);
-	free(p);
+	return (bits[i / 8] >> i % 8) & 1;
 }
 
 static void
 free_encoder(SymbolEncoder *pSE)
 {
-	unsigned long i;
-	for(i = 0; i < MAX_SYMBOLS; ++i)
-	{
-		huffman_code *p = (*pSE)[i];
-		if(p)
-			free_code(p);
-	}
-
 	free(pSE);
 }
 
@@ -263,181 +398,356 @@ init_frequencies(SymbolFrequencies *pSF)
 	memset(*pSF, 0, sizeof(SymbolFrequencies));
 }
 
-int init_cache(buf_cache* pc,
-					  unsigned int cache_size,
-					  unsigned char **pbufout,
-					  unsigned int *pbufoutlen)
-{
-	assert(pc && pbufout && pbufoutlen);
-	if(!pbufout || !pbufoutlen)
-		return 1;
-	
-	pc->cache = (unsigned char*)malloc(cache_size);
-	pc->cache_len = cache_size;
-	pc->cache_cur = 0;
-	pc->pbufout = pbufout;
-	*pbufout = NULL;
-	pc->pbufoutlen = pbufoutlen;
-	*pbufoutlen = 0;
-
-	return pc->cache ? 0 : 1;
-}
+/*
+ * The counts go into HISTOGRAM_WAYS sub-histograms, consecutive
+ * bytes into different ones, so that a run of the same byte does
+ * not have to wait for the store of one count before the next.
+ * The 32-bit sub-histograms are added into the 64-bit totals every
+ * HISTOGRAM_CHUNK bytes, before any of them can overflow.
+ */
+#define HISTOGRAM_WAYS 4
+#define HISTOGRAM_CHUNK (1u << 30)
 
-static void free_cache(buf_cache* pc)
+/*
+ * count_bytes adds the bytes of bufin to the sub-histograms. The
+ * input is read 8 bytes at a time; the order of the bytes within a
+ * word does not matter for the counts.
+ */
+static void
+count_bytes(uint32_t counts[HISTOGRAM_WAYS][MAX_SYMBOLS],
+			const unsigned char *bufin,
+			uint64_t bufinlen)
 {
-	assert(pc);
-	if(pc->cache)
+	const unsigned char *end = bufin + bufinlen;
+	uint64_t w;
+
+	while(end - bufin >= 8)
 	{
-		free(pc->cache);
-		pc->cache = NULL;
+		memcpy(&w, bufin, sizeof(w));
+		bufin += 8;
+		++counts[0][w & 0xff];
+		++counts[1][(w >> 8) & 0xff];
+		++counts[2][(w >> 16) & 0xff];
+		++counts[3][(w >> 24) & 0xff];
+		++counts[0][(w >> 32) & 0xff];
+		++counts[1][(w >> 40) & 0xff];
+		++counts[2][(w >> 48) & 0xff];
+		++counts[3][w >> 56];
 	}
+
+	while(bufin < end)
+		++counts[0][*bufin++];
 }
 
-int flush_cache(buf_cache* pc)
+static uint64_t
+get_symbol_frequencies_from_memory(SymbolFrequencies *pSF,
+								   const unsigned char *bufin,
+								   uint64_t bufinlen)
 {
-	assert(pc);
-	
-	if(pc->cache_cur > 0)
-	{
-		unsigned int newlen = pc->cache_cur + *pc->pbufoutlen;
-		unsigned char* tmp = realloc(*pc->pbufout, newlen);
-		if(!tmp)
-			return 1;
+	uint32_t counts[HISTOGRAM_WAYS][MAX_SYMBOLS];
+	uint64_t i, len;
+	unsigned int j, k;
 
-		memcpy(tmp + *pc->pbufoutlen, pc->cache, pc->cache_cur);
+	/* Set all frequencies to 0. */
+	init_frequencies(pSF);
 
-		*pc->pbufout = tmp;
-		*pc->pbufoutlen = newlen;
-		pc->cache_cur = 0;
+	/* Count the frequency of each symbol in the input file. */
+	for(i = 0; i < bufinlen; i += len)
+	{
+		len = bufinlen - i < HISTOGRAM_CHUNK ? bufinlen - i : HISTOGRAM_CHUNK;
+		memset(counts, 0, sizeof(counts));
+		count_bytes(counts, bufin + i, len);
+		for(k = 0; k < HISTOGRAM_WAYS; ++k)
+		{
+			for(j = 0; j < MAX_SYMBOLS; ++j)
+				(*pSF)[j] += counts[k][j];
+		}
 	}
 
-	return 0;
+	return bufinlen;
 }
 
-static int write_cache(buf_cache* pc,
-					   const void *to_write,
-					   unsigned int to_write_len)
+struct frequencies_struct
 {
-	unsigned char* tmp;
+	const unsigned char *bufin;
+	uint64_t bufinlen;
+	SymbolFrequencies *parts;
+};
 
-	assert(pc && to_write);
-	assert(pc->cache_len >= pc->cache_cur);
-	
-	/* If trying to write more than the cache will hold
-	 * flush the cache and allocate enough space immediately,
-	 * that is, don't use the cache. */
-	if(to_write_len > pc->cache_len - pc->cache_cur)
-	{
-		unsigned int newlen;
-		flush_cache(pc);
-		newlen = *pc->pbufoutlen + to_write_len;
-		tmp = realloc(*pc->pbufout, newlen);
-		if(!tmp)
-			return 1;
-		memcpy(tmp + *pc->pbufoutlen, to_write, to_write_len);
-		*pc->pbufout = tmp;
-		*pc->pbufoutlen = newlen;
-	}
-	else
-	{
-		/* Write the data to the cache. */
-		memcpy(pc->cache + pc->cache_cur, to_write, to_write_len);
-		pc->cache_cur += to_write_len;
-	}
+static int
+get_symbol_frequencies_threads(void *arguments, uint64_t i)
+{
+	struct frequencies_struct *args = (struct frequencies_struct *)arguments;
+	uint64_t start = i * TASK_SIZE;
+	uint64_t end = args->bufinlen - start < TASK_SIZE ?
+		args->bufinlen : start + TASK_SIZE;
 
+	get_symbol_frequencies_from_memory(&args->parts[i],
+									   args->bufin + start, end - start);
 	return 0;
 }
 
-static unsigned int
-get_symbol_frequencies_from_memory(SymbolFrequencies *pSF,
-								   const unsigned char *bufin,
-								   unsigned int bufinlen)
+/*
+ * get_symbol_frequencies_parallel counts like
+ * get_symbol_frequencies_from_memory, counting each of the nchunks
+ * chunks of TASK_SIZE bytes into its own histogram at parts[i] on
+ * up to nthreads threads. The histograms are added together once
+ * all of them are done.
+ */
+static uint64_t
+get_symbol_frequencies_parallel(SymbolFrequencies *pSF,
+								SymbolFrequencies *parts,
+								uint64_t nchunks,
+								unsigned int nthreads,
+								const unsigned char *bufin,
+								uint64_t bufinlen)
 {
-	unsigned int i;
-	
-	/* Set all frequencies to 0. */
+	struct frequencies_struct arguments;
+	uint64_t i;
+	unsigned int j;
+
+	arguments.bufin = bufin;
+	arguments.bufinlen = bufinlen;
+	arguments.parts = parts;
+	huffman_run_parallel(nthreads, nchunks,
+						 get_symbol_frequencies_threads, &arguments);
+
 	init_frequencies(pSF);
-	
-	/* Count the frequency of each symbol in the input file. */
-	for(i = 0; i < bufinlen; ++i)
+	for(i = 0; i < nchunks; ++i)
 	{
-		unsigned char uc = bufin[i];
-		if(!(*pSF)[uc])
-			(*pSF)[uc] = new_leaf_node(uc);
-		++(*pSF)[uc]->count;
+		for(j = 0; j < MAX_SYMBOLS; ++j)
+			(*pSF)[j] += parts[i][j];
 	}
 
 	return bufinlen;
 }
 
 /*
- * When used by qsort, SFComp sorts the array so that
- * the symbol with the lowest frequency is first. Any
- * NULL entries will be sorted to the end of the list.
+ * When used by qsort, SFComp sorts the leaves so that
+ * the symbol with the lowest frequency is first, and
+ * symbols of equal frequency by symbol value.
  */
 static int
 SFComp(const void *p1, const void *p2)
 {
-	const huffman_node *hn1 = *(const huffman_node**)p1;
-	const huffman_node *hn2 = *(const huffman_node**)p2;
+	const huffman_node *hn1 = (const huffman_node*)p1;
+	const huffman_node *hn2 = (const huffman_node*)p2;
 
-	/* Sort all NULLs to the end. */
-	if(hn1 == NULL && hn2 == NULL)
-		return 0;
-	if(hn1 == NULL)
-		return 1;
-	if(hn2 == NULL)
-		return -1;
-	
 	if(hn1->count > hn2->count)
 		return 1;
 	else if(hn1->count < hn2->count)
 		return -1;
 
-	return 0;
+	return (int)hn1->symbol - (int)hn2->symbol;
+}
+
+/*
+ * pop_least removes and returns the index of the node with the
+ * least count from the front of either the sorted leaves or the
+ * merged sets, which are created in order of count. A leaf wins
+ * a tie.
+ */
+static unsigned int
+pop_least(const huffman_tree *tree, unsigned int *pleaf, unsigned int *phead)
+{
+	if(*pleaf < tree->nleaves &&
+	   (*phead == tree->nnodes ||
+		tree->nodes[*pleaf].count <= tree->nodes[*phead].count))
+		return (*pleaf)++;
+
+	return (*phead)++;
 }
 
 
 /*
- * build_symbol_encoder builds a SymbolEncoder by walking
- * down to the leaves of the Huffman tree and then,
- * for each leaf, determines its code.
+ * get_code_lengths records the depth of each leaf of the
+ * Huffman tree as the code length of its symbol. A set comes
+ * after its subsets, so walking back from the root reaches
+ * every node after its parent.
  */
 static void
-build_symbol_encoder(huffman_node *subtree, SymbolEncoder *pSF)
+get_code_lengths(const huffman_tree *tree, unsigned int *lengths)
 {
-	if(subtree == NULL)
+	unsigned char depth[MAX_NODES];
+	unsigned int i;
+
+	if(tree->nnodes == 0)
 		return;
 
-	if(subtree->isLeaf)
-		(*pSF)[subtree->symbol] = new_code(subtree);
-	else
+	depth[tree->nnodes - 1] = 0;
+	for(i = tree->nnodes; i-- > 0; )
+	{
+		const huffman_node *p = &tree->nodes[i];
+
+		if(p->zero == NO_NODE)
+			lengths[p->symbol] = depth[i];
+		else
+			depth[p->zero] = depth[p->one] = depth[i] + 1;
+	}
+}
+
+/*
+ * assign_canonical_codes gives every symbol with a nonzero
+ * length its canonical code. Shorter codes come first and codes
+ * of the same length are consecutive in symbol order, so the
+ * lengths alone determine the codes. Each code is stored bit
+ * reversed, with the first bit to be written at position 0.
+ * The lengths must not exceed MAX_CODE_BITS.
+ */
+static void
+assign_canonical_codes(const unsigned char *lengths, uint64_t *codes)
+{
+	uint64_t next_code[MAX_CODE_BITS + 1];
+	unsigned int bl_count[MAX_CODE_BITS + 1];
+	uint64_t code = 0;
+	unsigned int i, j;
+
+	memset(bl_count, 0, sizeof(bl_count));
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+		++bl_count[lengths[i]];
+	bl_count[0] = 0;
+
+	for(i = 1; i <= MAX_CODE_BITS; ++i)
 	{
-		build_symbol_encoder(subtree->zero, pSF);
-		build_symbol_encoder(subtree->one, pSF);
+		code = (code + bl_count[i - 1]) << 1;
+		next_code[i] = code;
+	}
+
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		uint64_t reversed = 0;
+
+		if(lengths[i] == 0)
+			continue;
+
+		code = next_code[lengths[i]]++;
+		for(j = 0; j < lengths[i]; ++j)
+			reversed |= ((code >> j) & 1) << (lengths[i] - 1 - j);
+		codes[i] = reversed;
+	}
+}
+
+/*
+ * The lengths of the symbols being limited, together with what
+ * decides their order: shallower leaves first and, at the same
+ * depth, the more frequent symbol first.
+ */
+typedef struct code_length_tag
+{
+	unsigned int depth;
+	uint64_t count;
+	unsigned char symbol;
+} code_length;
+
+static int
+CLComp(const void *p1, const void *p2)
+{
+	const code_length *cl1 = (const code_length*)p1;
+	const code_length *cl2 = (const code_length*)p2;
+
+	if(cl1->depth != cl2->depth)
+		return cl1->depth < cl2->depth ? -1 : 1;
+	if(cl1->count != cl2->count)
+		return cl1->count > cl2->count ? -1 : 1;
+	return cl1->symbol < cl2->symbol ? -1 : 1;
+}
+
+/*
+ * limit_code_lengths rewrites the n nonzero depths of a complete
+ * Huffman tree so that none exceeds max_bits. It uses the
+ * adjustment from Annex K.3 of the JPEG standard: while some
+ * leaves are too deep, two sibling leaves at the deepest level
+ * are removed, one takes the place of their parent and the
+ * other is paired with the deepest leaf above them, which keeps
+ * the code complete. The resulting lengths go to the symbols in
+ * their original order, so the least frequent symbols absorb
+ * the extra bits. max_bits must allow for n codes.
+ */
+static void
+limit_code_lengths(unsigned int *depths,
+				   const uint64_t *counts,
+				   unsigned int n,
+				   unsigned int max_bits)
+{
+	code_length cl[MAX_SYMBOLS];
+	unsigned int bl_count[MAX_SYMBOLS];
+	unsigned int i, j, k, maxdepth = 0;
+
+	memset(bl_count, 0, sizeof(bl_count));
+	for(i = 0, k = 0; i < MAX_SYMBOLS; ++i)
+	{
+		if(depths[i] == 0)
+			continue;
+		cl[k].depth = depths[i];
+		cl[k].count = counts[i];
+		cl[k].symbol = (unsigned char)i;
+		++bl_count[depths[i]];
+		if(depths[i] > maxdepth)
+			maxdepth = depths[i];
+		++k;
+	}
+
+	if(maxdepth <= max_bits)
+		return;
+
+	for(i = maxdepth; i > max_bits; --i)
+	{
+		while(bl_count[i] > 0)
+		{
+			j = i - 2;
+			while(bl_count[j] == 0)
+				--j;
+			bl_count[i] -= 2;
+			bl_count[i - 1] += 1;
+			bl_count[j + 1] += 2;
+			bl_count[j] -= 1;
+		}
+	}
+
+	qsort(cl, n, sizeof(cl[0]), CLComp);
+	for(i = 1, k = 0; i <= max_bits; ++i)
+	{
+		for(j = 0; j < bl_count[i]; ++j)
+			depths[cl[k++].symbol] = i;
 	}
 }
 
 /*
- * calculate_huffman_codes turns pSF into an array
- * with a single entry that is the root of the
- * huffman tree. The return value is a SymbolEncoder,
- * which is an array of huffman codes index by symbol value.
+ * calculate_huffman_codes builds a Huffman tree from the
+ * symbol counts in pSF. The return value is a SymbolEncoder,
+ * which holds the canonical huffman codes indexed
+ * by symbol value. No code is longer than max_bits, or
+ * than the fewest bits that give every symbol a code.
  */
 static SymbolEncoder*
-calculate_huffman_codes(SymbolFrequencies * pSF)
+calculate_huffman_codes(const SymbolFrequencies *pSF, unsigned int max_bits)
 {
 	unsigned int i = 0;
 	unsigned int n = 0;
-	huffman_node *m1 = NULL, *m2 = NULL;
+	unsigned int m1, m2;
 	SymbolEncoder *pSE = NULL;
+	huffman_tree tree;
+	unsigned int leaf = 0, head;
+	unsigned int depths[MAX_SYMBOLS];
+	unsigned char lengths[MAX_SYMBOLS];
+	uint64_t codes[MAX_SYMBOLS];
 
-	/* Sort the symbol frequency array by ascending frequency. */
-	qsort((*pSF), MAX_SYMBOLS, sizeof((*pSF)[0]), SFComp);
+	/* Make a leaf for every symbol that occurs. */
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		if((*pSF)[i])
+		{
+			huffman_node *p = &tree.nodes[n++];
+			p->count = (*pSF)[i];
+			p->zero = p->one = NO_NODE;
+			p->symbol = (unsigned char)i;
+		}
+	}
 
-	/* Get the number of symbols. */
-	for(n = 0; n < MAX_SYMBOLS && (*pSF)[n]; ++n)
-		;
+	/* Sort the leaves by ascending frequency. */
+	qsort(tree.nodes, n, sizeof(tree.nodes[0]), SFComp);
+	tree.nleaves = tree.nnodes = n;
+	head = n;
 
 	/*
 	 * Construct a Huffman tree. This code is based
@@ -445,479 +755,2617 @@ calculate_huffman_codes(SymbolFrequencies * pSF)
 	 * by Ian Witten et al, 2nd edition, page 34.
 	 * Note that this implementation uses a simple
 	 * count instead of probability.
+	 *
+	 * The leaves are sorted once. Each merged set has at
+	 * least the count of the one merged before it, so
+	 * appending them in order keeps them sorted too, and
+	 * the two subsets of least probability are always at
+	 * the front of the leaves or of the sets.
 	 */
-	for(i = 0; i < n - 1; ++i)
+	for(i = 0; i + 1 < n; ++i)
 	{
+		huffman_node *p;
+
 		/* Set m1 and m2 to the two subsets of least probability. */
-		m1 = (*pSF)[0];
-		m2 = (*pSF)[1];
+		m1 = pop_least(&tree, &leaf, &head);
+		m2 = pop_least(&tree, &leaf, &head);
 
-		/* Replace m1 and m2 with a set {m1, m2} whose probability
+		/* Add a set {m1, m2} whose probability
 		 * is the sum of that of m1 and m2. */
-		(*pSF)[0] = m1->parent = m2->parent =
-			new_nonleaf_node(m1->count + m2->count, m1, m2);
-		(*pSF)[1] = NULL;
-		
-		/* Put newSet into the correct count position in pSF. */
-		qsort((*pSF), n, sizeof((*pSF)[0]), SFComp);
+		p = &tree.nodes[tree.nnodes++];
+		p->count = tree.nodes[m1].count + tree.nodes[m2].count;
+		p->zero = (uint16_t)m1;
+		p->one = (uint16_t)m2;
+	}
+
+	/* Get the code lengths from the tree. A lone
+	   symbol still needs a one bit code. */
+	memset(depths, 0, sizeof(depths));
+	get_code_lengths(&tree, depths);
+	if(n == 1)
+		depths[tree.nodes[0].symbol] = 1;
+
+	/* Limit the code lengths, but never below what it takes
+	   to give each of the n symbols a code. */
+	while(max_bits < 8 && n > (1u << max_bits))
+		++max_bits;
+	limit_code_lengths(depths, *pSF, n, max_bits);
+
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		assert(depths[i] <= HUFFMAN_MAX_CODE_BITS);
+		lengths[i] = (unsigned char)depths[i];
 	}
 
-	/* Build the SymbolEncoder array from the tree. */
+	/* Build the SymbolEncoder tables from the canonical codes. */
+	assign_canonical_codes(lengths, codes);
 	pSE = (SymbolEncoder*)malloc(sizeof(SymbolEncoder));
-	memset(pSE, 0, sizeof(SymbolEncoder));
-	build_symbol_encoder((*pSF)[0], pSE);
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		pSE->code[i] = (uint32_t)codes[i];
+		pSE->len[i] = lengths[i];
+	}
+
 	return pSE;
 }
 
 
 /*
- * Allocates memory and sets *pbufout to point to it. The memory
- * contains the code table.
+ * write_code_table_to_memory writes the header: the format
+ * version, the flags, the number of bytes that will be encoded
+ * (in 32 bits for V1 and 64 bits for V2) and the code length
+ * of every symbol from the first to the last one used. The
+ * codes are canonical, so the lengths are all the decoder needs.
+ * When no code is longer than 15 bits the lengths are packed two
+ * to a byte. For more than one stream, room is left at the end for
+ * the stream lengths, which encode_streams fills in. header must
+ * have room for MAX_HEADER_SIZE bytes. The return value is the
+ * length of the header.
  */
-static int
-write_code_table_to_memory(buf_cache *pc,
+static unsigned int
+write_code_table_to_memory(unsigned char *header,
 						   SymbolEncoder *se,
-						   uint32_t symbol_count)
+						   uint64_t symbol_count,
+						   unsigned int nstreams)
 {
-	uint32_t i, count = 0;
+	unsigned int i, first = MAX_SYMBOLS, last = 0, maxbits = 0, len;
+	unsigned int count_len = symbol_count > UINT32_MAX ? 8 : 4;
 
-	/* Determine the number of entries in se. */
 	for(i = 0; i < MAX_SYMBOLS; ++i)
 	{
-		if((*se)[i])
-			++count;
+		if(se->len[i])
+		{
+			if(first == MAX_SYMBOLS)
+				first = i;
+			last = i;
+			if(se->len[i] > maxbits)
+				maxbits = se->len[i];
+		}
 	}
 
-	/* Write the number of entries in network byte order. */
-	i = htonl(count);
-	
-	if(write_cache(pc, &i, sizeof(i)))
-		return 1;
+	header[0] = count_len == 8 ? HUFFMAN_FORMAT_V2 : HUFFMAN_FORMAT_V1;
+	header[1] = maxbits <= 15 ? HUFFMAN_FLAG_NIBBLES : 0;
 
-	/* Write the number of bytes that will be encoded. */
-	symbol_count = htonl(symbol_count);
-	if(write_cache(pc, &symbol_count, sizeof(symbol_count)))
-		return 1;
+	/* Write the number of bytes that will be encoded
+	   in network byte order. */
+	for(i = 0; i < count_len; ++i)
+		header[2 + i] = (unsigned char)(symbol_count >> (8 * (count_len - 1 - i)));
+	len = 2 + count_len;
 
-	/* Write the entries. */
-	for(i = 0; i < MAX_SYMBOLS; ++i)
+	/* The values of first and last are < MAX_SYMBOLS (256),
+	   so they can be stored in an unsigned char. */
+	if(first > last)
+		first = last;
+	header[len++] = (unsigned char)first;
+	header[len++] = (unsigned char)last;
+
+	/* Write the code lengths. */
+	for(i = first; i <= last; ++i)
 	{
-		huffman_code *p = (*se)[i];
-		if(p)
+		unsigned char numbits = se->len[i];
+
+		if(header[1] & HUFFMAN_FLAG_NIBBLES)
 		{
-			unsigned int numbytes;
-			/* The value of i is < MAX_SYMBOLS (256), so it can
-			be stored in an unsigned char. */
-			unsigned char uc = (unsigned char)i;
-			/* Write the 1 byte symbol. */
-			if(write_cache(pc, &uc, sizeof(uc)))
-				return 1;
-			/* Write the 1 byte code bit length. */
-			uc = (unsigned char)p->numbits;
-			if(write_cache(pc, &uc, sizeof(uc)))
-				return 1;
-			/* Write the code bytes. */
-			numbytes = numbytes_from_numbits(p->numbits);
-			if(write_cache(pc, p->bits, numbytes))
-				return 1;
+			if((i - first) % 2 == 0)
+				header[len++] = numbits;
+			else
+				header[len - 1] |= numbits << 4;
 		}
+		else
+			header[len++] = numbits;
 	}
 
-	return 0;
-}
+	if(nstreams > 1)
+	{
+		header[1] |= HUFFMAN_FLAG_STREAMS;
+		header[len++] = (unsigned char)nstreams;
+		memset(header + len, 0, 8 * (nstreams - 1));
+		len += 8 * (nstreams - 1);
+	}
+
+	return len;
+}
+
+/*
+ * The decoder resolves codes with lookup tables instead of walking
+ * the Huffman tree one bit at a time. The root table is indexed by
+ * the next root_bits bits of input (the first code bit is the lowest
+ * bit of the index) and resolves every code that is no longer than
+ * that in a single lookup. Longer codes go through a link entry to a
+ * subtable indexed by the bits that follow.
+ *
+ * Each table entry is packed into 32 bits. A leaf entry holds the
+ * symbol in bits 0-7 and the number of code bits it consumes at its
+ * level in bits 8-15. A link entry has bit 31 set, the width of the
+ * subtable in bits 24-28 and the offset of the subtable in bits 0-23.
+ * An entry of 0 marks a bit pattern that is not a valid code.
+ */
+#define DECODE_ROOT_BITS 11
+#define DECODE_LINK 0x80000000u
+
+#define LEAF_ENTRY(symbol, numbits) \
+	((uint32_t)(symbol) | ((uint32_t)(numbits) << 8))
+#define LINK_ENTRY(offset, width) \
+	(DECODE_LINK | ((uint32_t)(width) << 24) | (uint32_t)(offset))
+#define ENTRY_SYMBOL(e) ((unsigned char)((e) & 0xff))
+#define ENTRY_NUMBITS(e) (((e) >> 8) & 0xff)
+#define ENTRY_WIDTH(e) (((e) >> 24) & 0x1f)
+#define ENTRY_OFFSET(e) ((e) & 0xffffff)
+
+typedef struct decode_code_tag
+{
+	/* The code with its first bit at position 0. */
+	uint64_t code;
+	unsigned char numbits;
+	unsigned char symbol;
+} decode_code;
+
+typedef struct huffman_decoder_tag
+{
+	uint32_t *table;
+	unsigned int table_len;
+	unsigned int table_cap;
+	unsigned int root_bits;
+	unsigned int max_bits;
+
+	/* The number of symbols that can be decoded from one
+	   refill of the bit buffer. */
+	unsigned int per_refill;
+} huffman_decoder;
+
+/*
+ * bit_reader keeps up to 64 bits of input in bitbuf, the next
+ * unread bit in position 0. Once the input is exhausted it is
+ * padded with zero bits, which are counted in pad_bits so that
+ * reading past the end can be detected.
+ */
+typedef struct bit_reader_tag
+{
+	const unsigned char *cur;
+	const unsigned char *end;
+	uint64_t bitbuf;
+	unsigned int bitcount;
+	uint64_t pad_bits;
+} bit_reader;
+
+static uint64_t
+load_le64(const unsigned char *p)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+#else
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+		(uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+		(uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+		(uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+#endif
+}
+
+static void
+store_le64(unsigned char *p, uint64_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(p, &v, sizeof(v));
+#else
+	unsigned int i;
+	for(i = 0; i < 8; ++i)
+		p[i] = (unsigned char)(v >> (i * 8));
+#endif
+}
+
+static void
+init_bit_reader(bit_reader *br,
+				const unsigned char *bufin,
+				uint64_t bufinlen)
+{
+	br->cur = bufin;
+	br->end = bufin + bufinlen;
+	br->bitbuf = 0;
+	br->bitcount = 0;
+	br->pad_bits = 0;
+}
+
+/*
+ * refill tops bitbuf up to at least MAX_CODE_BITS bits. While 8
+ * bytes of input remain this is a single unaligned load; the bits
+ * above bitcount that it also brings in belong to the byte at cur
+ * and are simply loaded again by the next refill.
+ */
+static inline void
+refill(bit_reader *br)
+{
+	if(br->end - br->cur >= 8)
+	{
+		br->bitbuf |= load_le64(br->cur) << br->bitcount;
+		br->cur += (63 - br->bitcount) >> 3;
+		br->bitcount |= 56;
+		return;
+	}
+
+	while(br->bitcount <= 56)
+	{
+		if(br->cur < br->end)
+			br->bitbuf |= (uint64_t)*br->cur++ << br->bitcount;
+		else
+			br->pad_bits += 8;
+		br->bitcount += 8;
+	}
+}
+
+static inline void
+consume_bits(bit_reader *br, unsigned int numbits)
+{
+	br->bitbuf >>= numbits;
+	br->bitcount -= numbits;
+}
+
+/*
+ * decode_symbol decodes one symbol. The bit buffer must hold
+ * at least max_bits bits. Returns 1 on an invalid code.
+ */
+static inline int
+decode_symbol(const huffman_decoder *d, bit_reader *br, unsigned char *psym)
+{
+	unsigned int width = d->root_bits;
+	uint32_t e = d->table[br->bitbuf & ((1u << width) - 1)];
+
+	while(e & DECODE_LINK)
+	{
+		consume_bits(br, width);
+		width = ENTRY_WIDTH(e);
+		e = d->table[ENTRY_OFFSET(e) + (br->bitbuf & ((1u << width) - 1))];
+	}
+
+	if(e == 0)
+		return 1;
+
+	consume_bits(br, ENTRY_NUMBITS(e));
+	*psym = ENTRY_SYMBOL(e);
+	return 0;
+}
+
+static int
+reserve_table(huffman_decoder *d, unsigned int width, unsigned int *poffset)
+{
+	unsigned int size = 1u << width;
+
+	if(d->table_len + size > d->table_cap)
+	{
+		unsigned int newcap = d->table_cap ? d->table_cap : 1;
+		uint32_t *tmp;
+		while(newcap < d->table_len + size)
+			newcap *= 2;
+		tmp = (uint32_t*)realloc(d->table, newcap * sizeof(uint32_t));
+		if(!tmp)
+			return 1;
+		d->table = tmp;
+		d->table_cap = newcap;
+	}
+
+	memset(d->table + d->table_len, 0, size * sizeof(uint32_t));
+	*poffset = d->table_len;
+	d->table_len += size;
+	return 0;
+}
+
+/*
+ * fill_table fills the table of the given width at offset with
+ * codes, all of which share the same first consumed bits. Codes
+ * that do not fit in the table are grouped by the bits that index
+ * it and placed in subtables, recursively.
+ */
+static int
+fill_table(huffman_decoder *d,
+		   unsigned int offset,
+		   unsigned int width,
+		   unsigned int consumed,
+		   const decode_code *codes,
+		   unsigned int n)
+{
+	unsigned char maxbits[1 << DECODE_ROOT_BITS];
+	decode_code group[MAX_SYMBOLS];
+	uint32_t mask = (1u << width) - 1;
+	unsigned int i, j;
+
+	memset(maxbits, 0, sizeof(maxbits));
+
+	for(i = 0; i < n; ++i)
+	{
+		unsigned int numbits = codes[i].numbits - consumed;
+		uint32_t index = (uint32_t)(codes[i].code >> consumed) & mask;
+
+		if(numbits <= width)
+		{
+			/* Replicate the entry for every value
+			   of the bits that follow the code. */
+			for(j = index; j <= mask; j += 1u << numbits)
+			{
+				if(d->table[offset + j])
+					return 1;
+				d->table[offset + j] = LEAF_ENTRY(codes[i].symbol, numbits);
+			}
+		}
+		else if(numbits - width > maxbits[index])
+			maxbits[index] = (unsigned char)(numbits - width);
+	}
+
+	for(j = 0; j <= mask; ++j)
+	{
+		unsigned int subwidth, suboffset, count = 0;
+
+		if(maxbits[j] == 0)
+			continue;
+
+		if(d->table[offset + j])
+			return 1;
+
+		for(i = 0; i < n; ++i)
+		{
+			if(codes[i].numbits - consumed > width &&
+			   ((uint32_t)(codes[i].code >> consumed) & mask) == j)
+				group[count++] = codes[i];
+		}
+
+		subwidth = maxbits[j] < DECODE_ROOT_BITS
+			? maxbits[j] : DECODE_ROOT_BITS;
+		if(reserve_table(d, subwidth, &suboffset))
+			return 1;
+		d->table[offset + j] = LINK_ENTRY(suboffset, subwidth);
+
+		if(fill_table(d, suboffset, subwidth, consumed + width, group, count))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+free_decoder(huffman_decoder *d)
+{
+	free(d->table);
+	d->table = NULL;
+}
+
+/*
+ * init_decoder builds the decode tables for the n codes. Returns
+ * 1 if the codes are too long to decode or are not prefix free.
+ */
+static int
+init_decoder(huffman_decoder *d, const decode_code *codes, unsigned int n)
+{
+	unsigned int i, offset;
+
+	memset(d, 0, sizeof(*d));
+
+	for(i = 0; i < n; ++i)
+	{
+		if(codes[i].numbits == 0 || codes[i].numbits > MAX_CODE_BITS)
+			return 1;
+		if(codes[i].numbits > d->max_bits)
+			d->max_bits = codes[i].numbits;
+	}
+
+	d->root_bits = d->max_bits < DECODE_ROOT_BITS
+		? d->max_bits : DECODE_ROOT_BITS;
+	d->per_refill = d->max_bits ? MAX_CODE_BITS / d->max_bits : 1;
+
+	if(n == 0)
+		return 0;
+
+	if(reserve_table(d, d->root_bits, &offset) ||
+	   fill_table(d, offset, d->root_bits, 0, codes, n))
+	{
+		free_decoder(d);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * decode_memory decodes count symbols from the bit reader into
+ * bufout. Returns 1 if the input holds an invalid code or ends
+ * before count symbols have been decoded.
+ */
+static int
+decode_memory(const huffman_decoder *d,
+			  bit_reader *br,
+			  unsigned char *bufout,
+			  uint64_t count)
+{
+	unsigned char *end = bufout + count;
+
+	while(bufout < end)
+	{
+		unsigned int k = d->per_refill;
+		if((uint64_t)k > (uint64_t)(end - bufout))
+			k = (unsigned int)(end - bufout);
+
+		refill(br);
+		while(k-- > 0)
+		{
+			if(decode_symbol(d, br, bufout++))
+				return 1;
+		}
+
+		/* The padding must not have been consumed. */
+		if(br->pad_bits > br->bitcount)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * store_be64 and load_be64 write and read 64-bit values
+ * in network byte order.
+ */
+static void
+store_be64(unsigned char *p, uint64_t value)
+{
+	int i;
+
+	for(i = 7; i >= 0; --i, value >>= 8)
+		p[i] = (unsigned char)value;
+}
+
+static uint64_t
+load_be64(const unsigned char *p)
+{
+	uint64_t value = 0;
+	int i;
+
+	for(i = 0; i < 8; ++i)
+		value = value << 8 | p[i];
+	return value;
+}
+
+/*
+ * image_streams describes where the bitstreams of an image are:
+ * their number and the length in bytes of each, starting from the
+ * end of the header.
+ */
+typedef struct image_streams_tag
+{
+	unsigned int n;
+	uint64_t len[HUFFMAN_MAX_STREAMS];
+} image_streams;
+
+/*
+ * decode_four decodes rounds symbols from each of the four streams
+ * at br, one from every stream in turn, and writes the symbols of a
+ * round to bufout, stride bytes after those of the previous one.
+ * The streams are kept in local copies so that nothing they hold
+ * can be changed by the stores to bufout, and the lookups in them
+ * do not depend on each other, so the processor can work on all
+ * four at once.
+ */
+static int
+decode_four(const huffman_decoder *d,
+			bit_reader *br,
+			unsigned char *bufout,
+			unsigned int stride,
+			uint64_t rounds)
+{
+	bit_reader b0 = br[0], b1 = br[1], b2 = br[2], b3 = br[3];
+	unsigned char s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	unsigned int k;
+	int rc = 0;
+
+	while(rounds > 0 && rc == 0)
+	{
+		k = d->per_refill;
+		if((uint64_t)k > rounds)
+			k = (unsigned int)rounds;
+		rounds -= k;
+
+		refill(&b0);
+		refill(&b1);
+		refill(&b2);
+		refill(&b3);
+		while(k-- > 0)
+		{
+			rc = decode_symbol(d, &b0, &s0) | decode_symbol(d, &b1, &s1) |
+				decode_symbol(d, &b2, &s2) | decode_symbol(d, &b3, &s3);
+			if(rc)
+				break;
+			bufout[0] = s0;
+			bufout[1] = s1;
+			bufout[2] = s2;
+			bufout[3] = s3;
+			bufout += stride;
+		}
+
+		/* The padding must not have been consumed. */
+		if(rc || b0.pad_bits > b0.bitcount || b1.pad_bits > b1.bitcount ||
+		   b2.pad_bits > b2.bitcount || b3.pad_bits > b3.bitcount)
+			rc = 1;
+	}
+
+	br[0] = b0;
+	br[1] = b1;
+	br[2] = b2;
+	br[3] = b3;
+	return rc;
+}
+
+/*
+ * decode_strided decodes count symbols from br like decode_memory,
+ * but writes them stride bytes apart.
+ */
+static int
+decode_strided(const huffman_decoder *d,
+			   bit_reader *br,
+			   unsigned char *bufout,
+			   unsigned int stride,
+			   uint64_t count)
+{
+	for(; count > 0; --count, bufout += stride)
+	{
+		if(decode_memory(d, br, bufout, 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * decode_streams decodes count symbols from the streams of an
+ * image, the first of which starts at data, into bufout. The
+ * streams are decoded four at a time, and any that are left
+ * one at a time.
+ */
+static int
+decode_streams(const huffman_decoder *d,
+			   const unsigned char *data,
+			   const image_streams *streams,
+			   unsigned char *bufout,
+			   uint64_t count)
+{
+	bit_reader br[HUFFMAN_MAX_STREAMS];
+	uint64_t rounds = count / streams->n;
+	unsigned int n = streams->n, s;
+
+	for(s = 0; s < n; data += streams->len[s++])
+		init_bit_reader(&br[s], data, streams->len[s]);
+
+	for(s = 0; s + 4 <= n; s += 4)
+	{
+		if(decode_four(d, &br[s], bufout + s, n, rounds))
+			return 1;
+	}
+	for(; s < n; ++s)
+	{
+		if(decode_strided(d, &br[s], bufout + s, n, rounds))
+			return 1;
+	}
+
+	/* The first count % n streams hold one more symbol. */
+	bufout += rounds * n;
+	for(s = 0; s < count % n; ++s)
+	{
+		if(decode_memory(d, &br[s], bufout + s, 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+memread(const unsigned char* buf,
+		uint64_t buflen,
+		uint64_t *pindex,
+		void* bufout,
+		unsigned int readlen)
+{
+	assert(buf && pindex && bufout);
+	assert(buflen >= *pindex);
+	if(buflen < *pindex)
+		return 1;
+	if(readlen > buflen - *pindex)
+		return 1;
+	memcpy(bufout, buf + *pindex, readlen);
+	*pindex += readlen;
+	return 0;
+}
+
+/*
+ * read_legacy_code_table reads the code table of the legacy
+ * format, which holds every code bit by bit, into codes.
+ */
+static int
+read_legacy_code_table(const unsigned char* bufin,
+					   uint64_t bufinlen,
+					   uint64_t *pindex,
+					   uint64_t *pDataBytes,
+					   decode_code *codes,
+					   unsigned int *pn)
+{
+	uint32_t count, data_count;
+
+	/* Read the number of entries.
+	   (it is stored in network byte order). */
+	if(memread(bufin, bufinlen, pindex, &count, sizeof(count)))
+		return 1;
+
+	count = ntohl(count);
+	if(count > MAX_SYMBOLS)
+		return 1;
+
+	/* Read the number of data bytes this encoding represents. */
+	if(memread(bufin, bufinlen, pindex, &data_count, sizeof(data_count)))
+		return 1;
+
+	*pDataBytes = ntohl(data_count);
+
+	/* Read the entries. */
+	for(*pn = 0; *pn < count; ++*pn)
+	{
+		unsigned char bytes[32];
+		unsigned char numbits;
+		unsigned int i;
+		decode_code *p = &codes[*pn];
+
+		if(memread(bufin, bufinlen, pindex, &p->symbol, sizeof(p->symbol)))
+			return 1;
+
+		if(memread(bufin, bufinlen, pindex, &numbits, sizeof(numbits)))
+			return 1;
+
+		if(memread(bufin, bufinlen, pindex, bytes,
+				   numbytes_from_numbits(numbits)))
+			return 1;
+
+		if(numbits == 0 || numbits > MAX_CODE_BITS)
+			return 1;
+
+		p->numbits = numbits;
+		p->code = 0;
+		for(i = 0; i < numbits; ++i)
+			p->code |= (uint64_t)get_bit(bytes, i) << i;
+	}
+
+	return 0;
+}
+
+/*
+ * read_stream_lengths reads the number of streams and their lengths
+ * that follow the code lengths of a header with HUFFMAN_FLAG_STREAMS.
+ * The last stream takes the rest of the image.
+ */
+static int
+read_stream_lengths(const unsigned char* bufin,
+					uint64_t bufinlen,
+					uint64_t *pindex,
+					image_streams *streams)
+{
+	unsigned char n, len[8];
+	uint64_t total = 0;
+	unsigned int s;
+
+	if(memread(bufin, bufinlen, pindex, &n, sizeof(n)) ||
+	   n < 2 || n > HUFFMAN_MAX_STREAMS)
+		return 1;
+
+	streams->n = n;
+	for(s = 0; s + 1 < streams->n; ++s)
+	{
+		if(memread(bufin, bufinlen, pindex, len, sizeof(len)))
+			return 1;
+		streams->len[s] = load_be64(len);
+		if(streams->len[s] > UINT64_MAX - total)
+			return 1;
+		total += streams->len[s];
+	}
+
+	if(total > bufinlen - *pindex)
+		return 1;
+
+	streams->len[s] = bufinlen - *pindex - total;
+	return 0;
+}
+
+/*
+ * read_code_table_from_memory reads the header written by
+ * write_code_table_to_memory, or a legacy code table, and
+ * returns the codes it describes and where its streams are.
+ */
+static int
+read_code_table_from_memory(const unsigned char* bufin,
+							uint64_t bufinlen,
+							uint64_t *pindex,
+							uint64_t *pDataBytes,
+							decode_code *codes,
+							unsigned int *pn,
+							image_streams *streams)
+{
+	unsigned char version, flags, first, last;
+	unsigned char count[8];
+	unsigned int count_len;
+	unsigned char lengths[MAX_SYMBOLS];
+	uint64_t canonical[MAX_SYMBOLS];
+	unsigned int i;
+
+	if(*pindex < bufinlen && bufin[*pindex] == HUFFMAN_FORMAT_LEGACY)
+	{
+		if(read_legacy_code_table(bufin, bufinlen, pindex,
+								  pDataBytes, codes, pn))
+			return 1;
+		streams->n = 1;
+		streams->len[0] = bufinlen - *pindex;
+		return 0;
+	}
+
+	if(memread(bufin, bufinlen, pindex, &version, sizeof(version)) ||
+	   (version != HUFFMAN_FORMAT_V1 && version != HUFFMAN_FORMAT_V2))
+		return 1;
+
+	/* Flags this decoder does not know change the
+	   meaning of the data, so they are an error. */
+	if(memread(bufin, bufinlen, pindex, &flags, sizeof(flags)) ||
+	   (flags & ~(HUFFMAN_FLAG_NIBBLES | HUFFMAN_FLAG_STREAMS)))
+		return 1;
+
+	/* Read the number of data bytes this encoding represents
+	   (it is stored in network byte order). */
+	count_len = version == HUFFMAN_FORMAT_V2 ? 8 : 4;
+	if(memread(bufin, bufinlen, pindex, count, count_len))
+		return 1;
+
+	for(*pDataBytes = 0, i = 0; i < count_len; ++i)
+		*pDataBytes = *pDataBytes << 8 | count[i];
+
+	/* Read the code lengths. */
+	if(memread(bufin, bufinlen, pindex, &first, sizeof(first)) ||
+	   memread(bufin, bufinlen, pindex, &last, sizeof(last)) ||
+	   first > last)
+		return 1;
+
+	memset(lengths, 0, sizeof(lengths));
+	if(flags & HUFFMAN_FLAG_NIBBLES)
+	{
+		unsigned char packed[MAX_SYMBOLS / 2];
+		if(memread(bufin, bufinlen, pindex, packed, (last - first) / 2 + 1))
+			return 1;
+		for(i = first; i <= last; ++i)
+			lengths[i] = (packed[(i - first) / 2] >> ((i - first) % 2 * 4)) & 0x0f;
+	}
+	else if(memread(bufin, bufinlen, pindex, lengths + first, last - first + 1))
+		return 1;
+
+	for(i = first; i <= last; ++i)
+	{
+		if(lengths[i] > MAX_CODE_BITS)
+			return 1;
+	}
+
+	if(flags & HUFFMAN_FLAG_STREAMS)
+	{
+		if(read_stream_lengths(bufin, bufinlen, pindex, streams))
+			return 1;
+	}
+	else
+	{
+		streams->n = 1;
+		streams->len[0] = bufinlen - *pindex;
+	}
+
+	/* Rebuild the canonical codes from the lengths. */
+	assign_canonical_codes(lengths, canonical);
+	for(*pn = 0, i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		if(lengths[i])
+		{
+			codes[*pn].code = canonical[i];
+			codes[*pn].numbits = lengths[i];
+			codes[*pn].symbol = (unsigned char)i;
+			++*pn;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * get_max_code_bits returns the length of the
+ * longest code in se.
+ */
+static unsigned int
+get_max_code_bits(SymbolEncoder *se)
+{
+	unsigned int i, maxbits = 0;
+
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		if(se->len[i] > maxbits)
+			maxbits = se->len[i];
+	}
+
+	return maxbits;
+}
+
+/*
+ * get_encoded_bits returns the number of bits the symbols
+ * counted in pSF take once encoded.
+ */
+static uint64_t
+get_encoded_bits(const SymbolFrequencies *pSF, SymbolEncoder *se)
+{
+	uint64_t numbits = 0;
+	unsigned int i;
+
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+		numbits += (uint64_t)(*pSF)[i] * se->len[i];
+
+	return numbits;
+}
+
+/*
+ * do_memory_encode encodes count symbols, stride bytes apart from
+ * bufin on, into bufout and returns the number of bits written.
+ * The codes are ORed into a 64-bit accumulator and every flush
+ * stores all 8 bytes of it, but only advances past the bytes that
+ * are complete. bufout must therefore have 8 bytes of room past
+ * the encoded data. The bits of the last byte that are not used
+ * are 0.
+ */
+static uint64_t
+do_memory_encode(unsigned char *bufout,
+				 const unsigned char* bufin,
+				 uint64_t count,
+				 unsigned int stride,
+				 SymbolEncoder *se)
+{
+	unsigned char *out = bufout;
+	uint64_t acc = 0;
+	unsigned int nbits = 0;
+	unsigned int maxbits = get_max_code_bits(se);
+
+	/* The number of codes that fit in the accumulator on top
+	   of the up to 7 bits left over from the last flush. */
+	unsigned int per_flush = maxbits ? 56 / maxbits : 1;
+
+	while(count > 0)
+	{
+		unsigned int k = per_flush;
+		if((uint64_t)k > count)
+			k = (unsigned int)count;
+		count -= k;
+
+		while(k-- > 0)
+		{
+			unsigned char symbol = *bufin;
+			bufin += stride;
+			acc |= (uint64_t)se->code[symbol] << nbits;
+			nbits += se->len[symbol];
+		}
+
+		store_le64(out, acc);
+		out += nbits >> 3;
+		acc >>= nbits & ~7u;
+		nbits &= 7;
+	}
+
+	return (uint64_t)(out - bufout) * 8 + nbits;
+}
+
+/*
+ * encode_chunk_at encodes count symbols from bufin into data,
+ * starting at bit begin. end is the bit just past the encoded
+ * symbols, which the caller knows from the histogram of the chunk.
+ * Only the bytes that are complete by end are written, the first
+ * with 0 in the bits below begin, so chunks that are next to each
+ * other can be encoded at the same time. The bits of the byte end
+ * falls in are returned instead of written.
+ */
+static unsigned char
+encode_chunk_at(unsigned char *data,
+				uint64_t begin,
+				uint64_t end,
+				const unsigned char *bufin,
+				uint64_t count,
+				SymbolEncoder *se)
+{
+	unsigned char *out = data + begin / 8;
+	unsigned char *limit = data + end / 8;
+	uint64_t acc = 0;
+	unsigned int nbits = (unsigned int)(begin % 8);
+	unsigned int maxbits = get_max_code_bits(se);
+	unsigned int per_flush = maxbits ? 56 / maxbits : 1;
+
+	/* Store all 8 bytes of the accumulator, as do_memory_encode
+	   does, while they all fall below limit. */
+	while(count > 0 && limit - out >= 8)
+	{
+		unsigned int k = per_flush;
+		if((uint64_t)k > count)
+			k = (unsigned int)count;
+		count -= k;
+
+		while(k-- > 0)
+		{
+			unsigned char symbol = *bufin++;
+			acc |= (uint64_t)se->code[symbol] << nbits;
+			nbits += se->len[symbol];
+		}
+
+		store_le64(out, acc);
+		out += nbits >> 3;
+		acc >>= nbits & ~7u;
+		nbits &= 7;
+	}
+
+	/* Then write the last few bytes one at a time. */
+	while(count > 0)
+	{
+		unsigned char symbol = *bufin++;
+		acc |= (uint64_t)se->code[symbol] << nbits;
+		nbits += se->len[symbol];
+		--count;
+
+		for(; nbits >= 8; nbits -= 8)
+		{
+			*out++ = (unsigned char)acc;
+			acc >>= 8;
+		}
+	}
+
+	return (unsigned char)acc;
+}
+
+/*
+ * join_chunk_tails writes the partly used last byte of each of the
+ * n chunks that encode_chunk_at coded into data, chunk i covering
+ * bits offsets[i] to offsets[i + 1]. When the next chunk completes
+ * that byte it already holds the next chunk's bits and the tail is
+ * ORed in. A chunk too short to complete it passes the tail on.
+ */
+static void
+join_chunk_tails(unsigned char *data,
+				 const uint64_t *offsets,
+				 unsigned char *tails,
+				 uint64_t n)
+{
+	uint64_t i;
+
+	for(i = 0; i < n; ++i)
+	{
+		uint64_t last = offsets[i + 1] / 8;
+
+		if(offsets[i + 1] % 8 == 0)
+			continue;
+		if(i + 1 == n)
+			data[last] = tails[i];
+		else if(offsets[i + 2] / 8 > last)
+			data[last] |= tails[i];
+		else
+			tails[i + 1] |= tails[i];
+	}
+}
+
+/*
+ * encode_streams codes symbol i of bufin into stream i % nstreams.
+ * The streams are written to bufout one after the other, each
+ * starting on a byte boundary, and the length in bytes of all but
+ * the last is stored at lengths. bufout must have room for the
+ * encoded data, a byte per stream and the 8 bytes do_memory_encode
+ * may store past the end. Returns the number of bytes written.
+ */
+static uint64_t
+encode_streams(unsigned char *bufout,
+			   unsigned char *lengths,
+			   const unsigned char *bufin,
+			   uint64_t bufinlen,
+			   unsigned int nstreams,
+			   SymbolEncoder *se)
+{
+	uint64_t len = 0, n;
+	unsigned int s;
+
+	for(s = 0; s < nstreams; ++s)
+	{
+		/* The first bufinlen % nstreams streams
+		   hold one symbol more than the others. */
+		n = bufinlen / nstreams + (s < bufinlen % nstreams);
+		n = (do_memory_encode(bufout + len, bufin + s, n, nstreams, se) + 7) / 8;
+		if(s + 1 < nstreams)
+			store_be64(lengths + 8 * s, n);
+		len += n;
+	}
+
+	return len;
+}
+
+/*
+ * encode_image codes bufin as a single image with its own code
+ * table, using only the calling thread. Images coded this way
+ * share nothing, so several of them can be coded at once.
+ */
+static int
+encode_image(const unsigned char *bufin,
+			 uint64_t bufinlen,
+			 unsigned char **pbufout,
+			 uint64_t *pbufoutlen,
+			 const huffman_params *params)
+{
+	SymbolFrequencies sf;
+	SymbolEncoder *se;
+	int rc = 0;
+	uint64_t symbol_count, numbytes;
+	unsigned char header[MAX_HEADER_SIZE];
+	unsigned int header_len;
+	unsigned char *buf;
+
+	*pbufout = NULL;
+	*pbufoutlen = 0;
+
+	/* Get the frequency of each symbol in the input memory. */
+	symbol_count = get_symbol_frequencies_from_memory(&sf, bufin, bufinlen);
+
+	/* Build an optimal table from the symbolCount. */
+	se = calculate_huffman_codes(&sf, params->max_bits);
+
+	/* The counts and the code lengths give the size of the encoded
+	   data, to within the partly used last byte of every stream,
+	   so the output is allocated once. The encoder may store up
+	   to 8 bytes past the end of the data. */
+	header_len = write_code_table_to_memory(header, se, symbol_count,
+											params->streams);
+	numbytes = (get_encoded_bits(&sf, se) + 7) / 8 + params->streams - 1;
+	buf = header_len + numbytes + 8 > SIZE_MAX ? NULL :
+		(unsigned char*)malloc((size_t)(header_len + numbytes + 8));
+	if(!buf)
+		rc = 1;
+	else
+	{
+		memcpy(buf, header, header_len);
+
+		/* Scan the memory again and, using the table
+		   previously built, encode it into the output memory. */
+		numbytes = encode_streams(buf + header_len,
+								  buf + header_len - 8 * (params->streams - 1),
+								  bufin, bufinlen, params->streams, se);
+		*pbufout = buf;
+		*pbufoutlen = header_len + numbytes;
+	}
+
+	free_encoder(se);
+	return rc;
+}
+
+/*
+ * encode_blocks splits bufin into nblocks blocks of block_size
+ * bytes, the last of which may be shorter, and codes block i into
+ * images[i] and imagelens[i]. The blocks are handed out one at a
+ * time to params->threads threads.
+ */
+static int
+encode_blocks_threads(void *arguments, uint64_t i)
+{
+	struct blocks_encode_struct *args = (struct blocks_encode_struct *)arguments;
+	uint64_t len;
+
+	len = args->bufinlen - i * args->block_size;
+	if(len > args->block_size)
+		len = args->block_size;
+	return encode_image(args->bufin + i * args->block_size, len,
+						&args->images[i], &args->imagelens[i],
+						args->params);
+}
+
+static int
+encode_blocks(const unsigned char *bufin,
+			  uint64_t bufinlen,
+			  unsigned int block_size,
+			  uint64_t nblocks,
+			  unsigned char **images,
+			  uint64_t *imagelens,
+			  const huffman_params *params)
+{
+	struct blocks_encode_struct arguments;
+
+	arguments.bufin = bufin;
+	arguments.bufinlen = bufinlen;
+	arguments.block_size = block_size;
+	arguments.images = images;
+	arguments.imagelens = imagelens;
+	arguments.params = params;
+	return huffman_run_parallel(params->threads, nblocks,
+								encode_blocks_threads, &arguments);
+}
+
+/*
+ * write_index_trailer writes the end of the block index for a
+ * stream of nblocks blocks that decode to total bytes, and
+ * returns its length.
+ */
+static unsigned int
+write_index_trailer(unsigned char *p, uint64_t total, uint64_t nblocks)
+{
+	store_be64(p, total);
+	store_be64(p + 8, nblocks);
+	memcpy(p + 16, INDEX_MAGIC, 4);
+	return INDEX_TRAILER_SIZE;
+}
+
+#ifdef __linux__
+/*
+ * cgroup_cpu_limit returns the number of CPUs that the CPU quota of
+ * the cgroup of the process amounts to, rounded up, or 0 if there
+ * is no quota. cgroup v2 keeps the quota and the period in the
+ * cpu.max of the group, v1 in the cpu controller.
+ */
+static unsigned long
+cgroup_cpu_limit(void)
+{
+	char line[512], path[600], quota[32] = "";
+	long period = 0, q;
+	FILE *fp;
+	int v2 = 0;
+
+	/* The line for cgroup v2 starts with "0::". */
+	fp = fopen("/proc/self/cgroup", "r");
+	if(fp)
+	{
+		while(!v2 && fgets(line, sizeof(line), fp))
+		{
+			if(strncmp(line, "0::", 3) == 0)
+			{
+				line[strcspn(line, "\n")] = '\0';
+				snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max",
+						 line + 3);
+				v2 = 1;
+			}
+		}
+		fclose(fp);
+	}
+
+	if(v2 && (fp = fopen(path, "r")) != NULL)
+	{
+		if(fscanf(fp, "%31s %ld", quota, &period) != 2)
+			quota[0] = '\0';
+		fclose(fp);
+	}
+	else if((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL)
+	{
+		if(fscanf(fp, "%31s", quota) != 1)
+			quota[0] = '\0';
+		fclose(fp);
+
+		fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+		if(fp)
+		{
+			if(fscanf(fp, "%ld", &period) != 1)
+				period = 0;
+			fclose(fp);
+		}
+	}
+
+	/* No quota is "max" in v2 and -1 in v1. */
+	q = strtol(quota, NULL, 10);
+	if(q <= 0 || period <= 0)
+		return 0;
+
+	return (unsigned long)((q + period - 1) / period);
+}
+#endif
+
+/*
+ * available_cpus returns the number of CPUs the process may run
+ * on: those in its affinity mask, limited by the CPU quota of its
+ * cgroup, from 1 to HUFFMAN_MAX_THREADS.
+ */
+static unsigned int
+available_cpus(void)
+{
+	long n;
+
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	n = (long)info.dwNumberOfProcessors;
+#else
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+#ifdef __linux__
+	{
+		cpu_set_t set;
+		unsigned long limit = cgroup_cpu_limit();
+
+		if(sched_getaffinity(0, sizeof(set), &set) == 0)
+			n = CPU_COUNT(&set);
+		if(limit > 0 && (unsigned long)n > limit)
+			n = (long)limit;
+	}
+#endif
+
+	if(n < 1)
+		n = 1;
+	if(n > HUFFMAN_MAX_THREADS)
+		n = HUFFMAN_MAX_THREADS;
+	return (unsigned int)n;
+}
+
+/*
+ * The CPUs are counted once, on the first call to
+ * huffman_params_init, since reading the cgroup files costs far
+ * more than coding a short buffer.
+ */
+static unsigned int cpus;
+static pthread_once_t cpus_once = PTHREAD_ONCE_INIT;
+
+static void
+count_cpus(void)
+{
+	cpus = available_cpus();
+}
+
+void huffman_params_init(huffman_params *params)
+{
+	pthread_once(&cpus_once, count_cpus);
+
+	params->max_bits = HUFFMAN_MAX_CODE_BITS;
+	params->block_size = HUFFMAN_DEFAULT_BLOCK_SIZE;
+	params->block_index = 0;
+	params->streams = 1;
+	params->threads = cpus;
+}
+
+int huffman_encode_memory(const unsigned char *bufin,
+						  unsigned int bufinlen,
+						  unsigned char **pbufout,
+						  unsigned int *pbufoutlen)
+{
+	return huffman_encode_memory_ex(bufin, bufinlen,
+									pbufout, pbufoutlen, NULL);
+}
+
+int huffman_encode_memory_ex(const unsigned char *bufin,
+							 unsigned int bufinlen,
+							 unsigned char **pbufout,
+							 unsigned int *pbufoutlen,
+							 const huffman_params *params)
+{
+	uint64_t len;
+
+	if(!pbufoutlen ||
+	   huffman_encode_memory64_ex(bufin, bufinlen, pbufout, &len, params))
+		return 1;
+
+	/* The encoding of 4 GiB or less can still be longer. */
+	if(len > UINT32_MAX)
+	{
+		free(*pbufout);
+		*pbufout = NULL;
+		return 1;
+	}
+
+	*pbufoutlen = (unsigned int)len;
+	return 0;
+}
+
+int huffman_encode_memory64(const unsigned char *bufin,
+							uint64_t bufinlen,
+							unsigned char **pbufout,
+							uint64_t *pbufoutlen)
+{
+	return huffman_encode_memory64_ex(bufin, bufinlen,
+									  pbufout, pbufoutlen, NULL);
+}
+
+int huffman_encode_memory64_ex(const unsigned char *bufin,
+							   uint64_t bufinlen,
+							   unsigned char **pbufout,
+							   uint64_t *pbufoutlen,
+							   const huffman_params *params)
+{
+	SymbolFrequencies sf, *parts;
+	SymbolEncoder *se;
+	huffman_params defaults;
+	uint64_t i, nchunks;
+	uint64_t symbol_count, numbytes, *offsets;
+	unsigned char header[MAX_HEADER_SIZE];
+	unsigned char *tails;
+	unsigned int header_len;
+	unsigned char *buf;
+	struct block_encode_struct arguments;
+
+	if(!params)
+	{
+		huffman_params_init(&defaults);
+		params = &defaults;
+	}
+
+	/* Ensure the arguments are valid. */
+	if(!pbufout || !pbufoutlen || params->max_bits < 1 ||
+	   params->max_bits > HUFFMAN_MAX_CODE_BITS ||
+	   params->streams < 1 || params->streams > HUFFMAN_MAX_STREAMS ||
+	   params->threads < 1 || params->threads > HUFFMAN_MAX_THREADS)
+		return 1;
+
+	/* The chunks below are coded into a single stream. An image
+	   of several streams is coded on the calling thread. */
+	if(params->streams > 1)
+		return encode_image(bufin, bufinlen, pbufout, pbufoutlen, params);
+
+	*pbufout = NULL;
+	*pbufoutlen = 0;
+
+	/* The last chunk takes the bytes left over. Empty input is
+	   still a chunk of its own. */
+	nchunks = (bufinlen + TASK_SIZE - 1) / TASK_SIZE;
+	if(nchunks < 1)
+		nchunks = 1;
+
+	parts = (SymbolFrequencies*)malloc((size_t)nchunks * sizeof(*parts));
+	offsets = (uint64_t*)malloc((size_t)(nchunks + 1) * sizeof(*offsets));
+	tails = (unsigned char*)malloc((size_t)nchunks);
+	if(!parts || !offsets || !tails)
+	{
+		free(parts);
+		free(offsets);
+		free(tails);
+		return 1;
+	}
+
+	/* Get the frequency of each symbol in the input memory, and
+	   in each of the chunks it is encoded in. */
+	symbol_count = get_symbol_frequencies_parallel(&sf, parts, nchunks,
+												   params->threads,
+												   bufin, bufinlen);
+
+	/* Build an optimal table from the symbolCount. */
+	se = calculate_huffman_codes(&sf, params->max_bits);
+
+	header_len = write_code_table_to_memory(header, se, symbol_count, 1);
+
+	/* The histogram of a chunk gives its exact length once encoded.
+	   Summing the lengths of the chunks before it gives the bit each
+	   chunk starts at, so the output is allocated once and every
+	   chunk is encoded straight into place. */
+	offsets[0] = 0;
+	for(i = 0; i < nchunks; ++i)
+		offsets[i + 1] = offsets[i] + get_encoded_bits(&parts[i], se);
+	numbytes = (offsets[nchunks] + 7) / 8;
+
+	buf = header_len + numbytes > SIZE_MAX ? NULL :
+		(unsigned char*)malloc((size_t)(header_len + numbytes));
+	if(buf)
+	{
+		memcpy(buf, header, header_len);
+
+		/* Scan the memory again and, using the table
+		   previously built, encode it into the output memory. */
+		arguments.bufin = bufin;
+		arguments.bufinlen = bufinlen;
+		arguments.data = buf + header_len;
+		arguments.offsets = offsets;
+		arguments.tails = tails;
+		arguments.se = se;
+		huffman_run_parallel(params->threads, nchunks,
+							 do_memory_encode_threads, &arguments);
+
+		/* Only the bytes where one chunk ends and the next begins
+		   are left to fill in. */
+		join_chunk_tails(buf + header_len, offsets, tails, nchunks);
+
+		*pbufout = buf;
+		*pbufoutlen = header_len + numbytes;
+	}
+
+	free_encoder(se);
+	free(parts);
+	free(offsets);
+	free(tails);
+	return buf == NULL;
+}
+
+/*
+ * huffman_encode_memory_blocks writes a HUFFMAN_FORMAT_BLOCKS
+ * stream: the input is cut into blocks of params->block_size bytes
+ * and every block is coded with its own table. The blocks do not
+ * depend on each other, so no histogram of the whole input is
+ * needed and the blocks are coded in parallel.
+ */
+int huffman_encode_memory_blocks(const unsigned char *bufin,
+								 uint64_t bufinlen,
+								 unsigned char **pbufout,
+								 uint64_t *pbufoutlen,
+								 const huffman_params *params)
+{
+	huffman_params defaults;
+	unsigned char **images;
+	uint64_t *imagelens;
+	uint64_t nblocks, i, len;
+	unsigned char *buf;
+	uint32_t blocklen;
+	int rc;
+
+	if(!params)
+	{
+		huffman_params_init(&defaults);
+		params = &defaults;
+	}
+
+	/* Ensure the arguments are valid. */
+	if(!pbufout || !pbufoutlen || params->max_bits < 1 ||
+	   params->max_bits > HUFFMAN_MAX_CODE_BITS ||
+	   params->streams < 1 || params->streams > HUFFMAN_MAX_STREAMS ||
+	   params->threads < 1 || params->threads > HUFFMAN_MAX_THREADS ||
+	   params->block_size < 1 ||
+	   params->block_size > HUFFMAN_MAX_BLOCK_SIZE)
+		return 1;
+
+	*pbufout = NULL;
+	*pbufoutlen = 0;
+
+	nblocks = bufinlen / params->block_size +
+		(bufinlen % params->block_size != 0);
+	if(nblocks > SIZE_MAX / sizeof(*images))
+		return 1;
+
+	images = (unsigned char**)calloc((size_t)nblocks + 1, sizeof(*images));
+	imagelens = (uint64_t*)calloc((size_t)nblocks + 1, sizeof(*imagelens));
+	rc = !images || !imagelens;
+
+	if(rc == 0)
+		rc = encode_blocks(bufin, bufinlen, params->block_size, nblocks,
+						   images, imagelens, params);
+
+	/* The version, then the length in network byte order and the
+	   image of every block, then a block of length 0 and the
+	   index if one was asked for. */
+	len = 1 + 4;
+	for(i = 0; rc == 0 && i < nblocks; ++i)
+		len += 4 + imagelens[i];
+	if(params->block_index)
+		len += nblocks * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+
+	buf = rc || len > SIZE_MAX ? NULL : (unsigned char*)malloc((size_t)len);
+	if(buf)
+	{
+		len = 0;
+		buf[len++] = HUFFMAN_FORMAT_BLOCKS;
+		for(i = 0; i < nblocks; ++i)
+		{
+			blocklen = htonl((uint32_t)imagelens[i]);
+			memcpy(buf + len, &blocklen, sizeof(blocklen));
+			memcpy(buf + len + 4, images[i], (size_t)imagelens[i]);
+			len += 4 + imagelens[i];
+		}
+		memset(buf + len, 0, 4);
+		len += 4;
+
+		if(params->block_index)
+		{
+			uint64_t offset = 1;
+			for(i = 0; i < nblocks; ++i)
+			{
+				store_be64(buf + len, offset);
+				store_be64(buf + len + 8, i * params->block_size);
+				offset += 4 + imagelens[i];
+				len += INDEX_ENTRY_SIZE;
+			}
+			len += write_index_trailer(buf + len, bufinlen, nblocks);
+		}
+
+		*pbufout = buf;
+		*pbufoutlen = len;
+	}
+	else
+		rc = 1;
+
+	for(i = 0; images && i < nblocks; ++i)
+		free(images[i]);
+	free(images);
+	free(imagelens);
+	return rc;
+}
+
+/*
+ * read_image_count reads the number of bytes that the legacy,
+ * V1 or V2 image at bufin decodes to.
+ */
+static int
+read_image_count(const unsigned char *bufin,
+				 uint64_t bufinlen,
+				 uint64_t *pcount)
+{
+	decode_code codes[MAX_SYMBOLS];
+	image_streams streams;
+	uint64_t i = 0;
+	unsigned int ncodes = 0;
+
+	return read_code_table_from_memory(bufin, bufinlen, &i, pcount,
+									   codes, &ncodes, &streams);
+}
+
+/*
+ * decode_image decodes the legacy, V1 or V2 image at bufin into
+ * bufout, which must have room for the count of bytes given by
+ * read_image_count.
+ */
+static int
+decode_image(const unsigned char *bufin,
+			 uint64_t bufinlen,
+			 unsigned char *bufout,
+			 uint64_t count)
+{
+	huffman_decoder decoder;
+	decode_code codes[MAX_SYMBOLS];
+	image_streams streams;
+	bit_reader br;
+	unsigned int ncodes = 0;
+	uint64_t data_count;
+	uint64_t i = 0;
+	int rc;
+
+	/* Read the Huffman code table and build the decode tables. */
+	if(read_code_table_from_memory(bufin, bufinlen, &i, &data_count,
+								   codes, &ncodes, &streams) ||
+	   data_count != count ||
+	   (ncodes == 0 && data_count > 0) ||
+	   init_decoder(&decoder, codes, ncodes))
+		return 1;
+
+	/* Decode the memory. */
+	if(streams.n > 1)
+		rc = decode_streams(&decoder, bufin + i, &streams, bufout, data_count);
+	else
+	{
+		init_bit_reader(&br, bufin + i, bufinlen - i);
+		rc = decode_memory(&decoder, &br, bufout, data_count);
+	}
+	free_decoder(&decoder);
+	return rc;
+}
+
+/*
+ * decode_blocks walks the blocks of a HUFFMAN_FORMAT_BLOCKS
+ * stream and sets *ptotal to the number of bytes they decode to.
+ * When bufout is not NULL the blocks are also decoded into it,
+ * one after the other.
+ */
+static int
+decode_blocks(const unsigned char *bufin,
+			  uint64_t bufinlen,
+			  unsigned char *bufout,
+			  uint64_t *ptotal)
+{
+	uint64_t i = 1, count;
+	uint32_t len;
+
+	*ptotal = 0;
+	for(;;)
+	{
+		if(memread(bufin, bufinlen, &i, &len, sizeof(len)))
+			return 1;
+
+		len = ntohl(len);
+		if(len == 0)
+			return 0;
+
+		if(len > bufinlen - i ||
+		   read_image_count(bufin + i, len, &count) ||
+		   count > UINT64_MAX - *ptotal)
+			return 1;
+
+		if(bufout && decode_image(bufin + i, len, bufout + *ptotal, count))
+			return 1;
+
+		*ptotal += count;
+		i += len;
+	}
+}
+
+/*
+ * bit_position returns the number of bits read by br
+ * since the start of data.
+ */
+static uint64_t
+bit_position(const bit_reader *br, const unsigned char *data)
+{
+	return (uint64_t)(br->cur - data) * 8 + br->pad_bits - br->bitcount;
+}
+
+/*
+ * seek_bit_reader sets br up to read the datalen bytes at data
+ * from bit pos on.
+ */
+static void
+seek_bit_reader(bit_reader *br,
+				const unsigned char *data,
+				uint64_t datalen,
+				uint64_t pos)
+{
+	init_bit_reader(br, data + pos / 8, datalen - pos / 8);
+	refill(br);
+	consume_bits(br, (unsigned int)(pos % 8));
+}
+
+/* The number of symbol starts that the speculative decoder records
+   at either end of a segment while looking for a common one. */
+#define SYNC_WINDOW 1024
+
+/* The smallest segment worth a thread of its own. It is much longer
+   than SYNC_WINDOW codes, so a segment always resynchronizes, if at
+   all, before its end. */
+#define SYNC_MIN_SEGMENT (1 << 16)
+
+/*
+ * A segment of a single-stream image for the speculative decoder.
+ * head holds where the first symbols decoded from start begin, and
+ * tail where the symbols begin once the decode has passed end, the
+ * start of the next segment. tail_index is the number of symbols
+ * decoded before tail[0]. sync and count are the verified first
+ * bit and number of symbols of the segment.
+ */
+typedef struct sync_segment_tag
+{
+	const huffman_decoder *decoder;
+	const unsigned char *data;
+	uint64_t datalen;
+	uint64_t start;
+	uint64_t end;
+	uint64_t head[SYNC_WINDOW];
+	unsigned int nhead;
+	uint64_t tail[SYNC_WINDOW];
+	unsigned int ntail;
+	uint64_t tail_index;
+	uint64_t sync;
+	uint64_t count;
+	unsigned char *bufout;
+	int rc;
+} sync_segment;
+
+/*
+ * scan_segment decodes from the start of a segment, which need not
+ * be the start of a code, to SYNC_WINDOW symbols past its end,
+ * recording the symbol starts of its head and its tail. Nothing is
+ * stored. An invalid code ends the scan early.
+ */
+static void
+scan_segment(sync_segment *seg)
+{
+	bit_reader br;
+	uint64_t pos, n = 0, databits = seg->datalen * 8;
+	unsigned char symbol;
+	unsigned int k;
+
+	seg->nhead = 0;
+	seg->ntail = 0;
+	seg->tail_index = 0;
+	seek_bit_reader(&br, seg->data, seg->datalen, seg->start);
+
+	for(;;)
+	{
+		refill(&br);
+		for(k = seg->decoder->per_refill; k > 0; --k)
+		{
+			pos = bit_position(&br, seg->data);
+			if(pos >= databits)
+				return;
+
+			if(seg->nhead < SYNC_WINDOW)
+				seg->head[seg->nhead++] = pos;
+
+			if(pos >= seg->end)
+			{
+				if(seg->ntail == SYNC_WINDOW)
+					return;
+				if(seg->ntail == 0)
+					seg->tail_index = n;
+				seg->tail[seg->ntail++] = pos;
+			}
+
+			if(decode_symbol(seg->decoder, &br, &symbol))
+				return;
+			++n;
+		}
+	}
+}
+
+/*
+ * sync_segments finds where the scans of neighbouring segments
+ * first pass through the same symbol start. The first segment
+ * starts with a code, so its scan is right, and from the common
+ * start on the scan of the next segment is right too. This gives
+ * every segment its verified start and symbol count, and its place
+ * in bufout. Returns 1 if some segment does not resynchronize
+ * within SYNC_WINDOW symbols.
+ */
+static int
+sync_segments(sync_segment *segs,
+			  unsigned int nsegs,
+			  unsigned char *bufout,
+			  uint64_t count)
+{
+	uint64_t index = 0, total = 0;
+	unsigned int t, i, j;
+
+	segs[0].sync = segs[0].start;
+	for(t = 0; t + 1 < nsegs; ++t)
+	{
+		sync_segment *a = &segs[t], *b = &segs[t + 1];
+
+		/* Both lists are in increasing order. */
+		for(i = 0, j = 0; i < a->ntail && j < b->nhead &&
+				a->tail[i] != b->head[j]; )
+		{
+			if(a->tail[i] < b->head[j])
+				++i;
+			else
+				++j;
+		}
+
+		if(i == a->ntail || j == b->nhead)
+			return 1;
+
+		/* index is the number of symbols a decoded before
+		   its own verified start. */
+		a->count = a->tail_index + i - index;
+		a->bufout = bufout + total;
+		total += a->count;
+		b->sync = b->head[j];
+		index = j;
+	}
+
+	if(total > count)
+		return 1;
+
+	segs[nsegs - 1].count = count - total;
+	segs[nsegs - 1].bufout = bufout + total;
+	return 0;
+}
+
+/*
+ * decode_segment decodes the verified symbols of a segment
+ * into its place in the output.
+ */
+static void
+decode_segment(sync_segment *seg)
+{
+	bit_reader br;
+
+	seek_bit_reader(&br, seg->data, seg->datalen, seg->sync);
+	seg->rc = decode_memory(seg->decoder, &br, seg->bufout, seg->count);
+}
+
+static int
+scan_segment_threads(void *arguments, uint64_t t)
+{
+	scan_segment(&((sync_segment *)arguments)[t]);
+	return 0;
+}
+
+static int
+decode_segment_threads(void *arguments, uint64_t t)
+{
+	sync_segment *seg = &((sync_segment *)arguments)[t];
+
+	decode_segment(seg);
+	return seg->rc;
+}
 
+/*
+ * run_segments scans the segments, or decodes them when decode is
+ * not 0, with a thread for each segment.
+ */
 static int
-memread(const unsigned char* buf,
-		unsigned int buflen,
-		unsigned int *pindex,
-		void* bufout,
-		unsigned int readlen)
+run_segments(sync_segment *segs, unsigned int nsegs, int decode)
 {
-	assert(buf && pindex && bufout);
-	assert(buflen >= *pindex);
-	if(buflen < *pindex)
-		return 1;
-	if(readlen + *pindex >= buflen)
-		return 1;
-	memcpy(bufout, buf + *pindex, readlen);
-	*pindex += readlen;
-	return 0;
+	return huffman_run_parallel(nsegs, nsegs,
+								decode ? decode_segment_threads
+									   : scan_segment_threads,
+								segs);
 }
 
-static huffman_node*
-read_code_table_from_memory(const unsigned char* bufin,
-							unsigned int bufinlen,
-							unsigned int *pindex,
-							uint32_t *pDataBytes)
+/*
+ * decode_image_speculative decodes a single-stream image like
+ * decode_image, but on up to nthreads threads. The bitstream is cut
+ * into segments at byte boundaries and every segment is scanned on
+ * its own thread from a position that need not be the start of a
+ * code. Huffman codes tend to resynchronize within a few symbols,
+ * so sync_segments can stitch the scans together, after which the
+ * segments are decoded in parallel straight into place. An image
+ * of several streams, or whose segments do not resynchronize, is
+ * decoded on one thread.
+ */
+static int
+decode_image_speculative(const unsigned char *bufin,
+						 uint64_t bufinlen,
+						 unsigned char *bufout,
+						 uint64_t count,
+						 unsigned int nthreads)
 {
-	huffman_node *root = new_nonleaf_node(0, NULL, NULL);
-	uint32_t count;
-	
-	/* Read the number of entries.
-	   (it is stored in network byte order). */
-	if(memread(bufin, bufinlen, pindex, &count, sizeof(count)))
+	huffman_decoder decoder;
+	decode_code codes[MAX_SYMBOLS];
+	image_streams streams;
+	sync_segment *segs;
+	unsigned int ncodes = 0, nsegs, t;
+	uint64_t data_count, i = 0, seglen;
+	int rc;
+
+	if(bufinlen / SYNC_MIN_SEGMENT < 2)
+		return decode_image(bufin, bufinlen, bufout, count);
+
+	/* Read the Huffman code table and build the decode tables. */
+	if(read_code_table_from_memory(bufin, bufinlen, &i, &data_count,
+								   codes, &ncodes, &streams) ||
+	   data_count != count ||
+	   (ncodes == 0 && data_count > 0) ||
+	   init_decoder(&decoder, codes, ncodes))
+		return 1;
+
+	nsegs = (bufinlen - i) / SYNC_MIN_SEGMENT < nthreads
+		? (unsigned int)((bufinlen - i) / SYNC_MIN_SEGMENT) : nthreads;
+	if(nsegs < 2 || ncodes < 2 || streams.n > 1)
 	{
-		free_huffman_tree(root);
-		return NULL;
+		free_decoder(&decoder);
+		return decode_image(bufin, bufinlen, bufout, count);
 	}
 
-	count = ntohl(count);
-
-	/* Read the number of data bytes this encoding represents. */
-	if(memread(bufin, bufinlen, pindex, pDataBytes, sizeof(*pDataBytes)))
+	segs = (sync_segment*)malloc(nsegs * sizeof(*segs));
+	if(!segs)
 	{
-		free_huffman_tree(root);
-		return NULL;
+		free_decoder(&decoder);
+		return 1;
 	}
 
-	*pDataBytes = ntohl(*pDataBytes);
+	seglen = (bufinlen - i) / nsegs;
+	for(t = 0; t < nsegs; ++t)
+	{
+		segs[t].decoder = &decoder;
+		segs[t].data = bufin + i;
+		segs[t].datalen = bufinlen - i;
+		segs[t].start = t * seglen * 8;
+		segs[t].end = t + 1 < nsegs ? (t + 1) * seglen * 8 : segs[t].start;
+		segs[t].rc = 0;
+	}
 
-	/* Read the entries. */
-	while(count-- > 0)
+	rc = run_segments(segs, nsegs, 0);
+	if(rc == 0)
 	{
-		unsigned int curbit;
-		unsigned char symbol;
-		unsigned char numbits;
-		unsigned char numbytes;
-		unsigned char *bytes;
-		huffman_node *p = root;
+		if(sync_segments(segs, nsegs, bufout, count))
+			rc = decode_image(bufin, bufinlen, bufout, count);
+		else
+			rc = run_segments(segs, nsegs, 1);
+	}
 
-		if(memread(bufin, bufinlen, pindex, &symbol, sizeof(symbol)))
-		{
-			free_huffman_tree(root);
-			return NULL;
-		}
+	free(segs);
+	free_decoder(&decoder);
+	return rc;
+}
 
-		if(memread(bufin, bufinlen, pindex, &numbits, sizeof(numbits)))
+/* An encoded image and where it decodes to. */
+typedef struct decode_job_tag
+{
+	const unsigned char *image;
+	uint64_t len;
+	unsigned char *out;
+	uint64_t count;
+} decode_job;
+
+/*
+ * read_block_index reads the index at the end of a
+ * HUFFMAN_FORMAT_BLOCKS stream into a job for each block and sets
+ * *ptotal to the decoded length. The entries are checked to match
+ * the block lengths and to cover the stream and the decoded data
+ * without gaps, so the jobs can be decoded in any order. It
+ * returns 1 if there is no usable index.
+ */
+static int
+read_block_index(const unsigned char *bufin,
+				 uint64_t bufinlen,
+				 decode_job **pjobs,
+				 uint64_t *pnjobs,
+				 uint64_t *ptotal)
+{
+	const unsigned char *entries;
+	decode_job *jobs;
+	uint64_t n, i, end, offset = 1, start = 0, next_offset, next_start;
+	uint32_t len;
+
+	if(bufinlen < 1 + 4 + INDEX_TRAILER_SIZE ||
+	   memcmp(bufin + bufinlen - 4, INDEX_MAGIC, 4) != 0)
+		return 1;
+
+	*ptotal = load_be64(bufin + bufinlen - INDEX_TRAILER_SIZE);
+	n = load_be64(bufin + bufinlen - INDEX_TRAILER_SIZE + 8);
+	if(n > (bufinlen - 1 - 4 - INDEX_TRAILER_SIZE) / INDEX_ENTRY_SIZE ||
+	   n >= SIZE_MAX / sizeof(*jobs))
+		return 1;
+
+	/* The block of length 0 is just before the entries. */
+	entries = bufin + bufinlen - INDEX_TRAILER_SIZE - n * INDEX_ENTRY_SIZE;
+	end = (uint64_t)(entries - bufin) - 4;
+	if(memcmp(bufin + end, "\0\0\0\0", 4) != 0 ||
+	   (n > 0 && (load_be64(entries) != offset ||
+				  load_be64(entries + 8) != start)))
+		return 1;
+
+	jobs = (decode_job*)malloc((size_t)(n + 1) * sizeof(*jobs));
+	if(!jobs)
+		return 1;
+
+	for(i = 0; i < n; ++i)
+	{
+		if(i + 1 < n)
 		{
-			free_huffman_tree(root);
-			return NULL;
+			next_offset = load_be64(entries + (i + 1) * INDEX_ENTRY_SIZE);
+			next_start = load_be64(entries + (i + 1) * INDEX_ENTRY_SIZE + 8);
 		}
-		
-		numbytes = (unsigned char)numbytes_from_numbits(numbits);
-		bytes = (unsigned char*)malloc(numbytes);
-		if(memread(bufin, bufinlen, pindex, bytes, numbytes))
+		else
 		{
-			free(bytes);
-			free_huffman_tree(root);
-			return NULL;
+			next_offset = end;
+			next_start = *ptotal;
 		}
 
-		/*
-		 * Add the entry to the Huffman tree. The value
-		 * of the current bit is used switch between
-		 * zero and one child nodes in the tree. New nodes
-		 * are added as needed in the tree.
-		 */
-		for(curbit = 0; curbit < numbits; ++curbit)
+		if(next_offset > end || next_offset < offset + 5 ||
+		   next_start < start)
+			break;
+
+		memcpy(&len, bufin + offset, sizeof(len));
+		len = ntohl(len);
+		if(len != next_offset - offset - 4)
+			break;
+
+		jobs[i].image = bufin + offset + 4;
+		jobs[i].len = len;
+		jobs[i].out = NULL;
+		jobs[i].count = next_start - start;
+		offset = next_offset;
+		start = next_start;
+	}
+
+	if(i < n || offset != end || start != *ptotal)
+	{
+		free(jobs);
+		return 1;
+	}
+
+	*pjobs = jobs;
+	*pnjobs = n;
+	return 0;
+}
+
+/*
+ * decode_jobs decodes the n images of jobs on nthreads threads,
+ * handing the images out one at a time.
+ */
+static int
+decode_jobs_threads(void *arguments, uint64_t i)
+{
+	decode_job *job = &((decode_job *)arguments)[i];
+
+	return decode_image(job->image, job->len, job->out, job->count);
+}
+
+static int
+decode_jobs(decode_job *jobs, uint64_t n, unsigned int nthreads)
+{
+	return huffman_run_parallel(nthreads, n, decode_jobs_threads, jobs);
+}
+
+int huffman_decode_memory(const unsigned char *bufin,
+						  unsigned int bufinlen,
+						  unsigned char **pbufout,
+						  unsigned int *pbufoutlen)
+{
+	uint64_t len;
+
+	if(!pbufoutlen ||
+	   huffman_decode_memory64_ex(bufin, bufinlen, pbufout, &len, NULL))
+		return 1;
+
+	if(len > UINT32_MAX)
+	{
+		free(*pbufout);
+		*pbufout = NULL;
+		return 1;
+	}
+
+	*pbufoutlen = (unsigned int)len;
+	return 0;
+}
+
+int huffman_decode_memory64(const unsigned char *bufin,
+							uint64_t bufinlen,
+							unsigned char **pbufout,
+							uint64_t *pbufoutlen)
+{
+	return huffman_decode_memory64_ex(bufin, bufinlen,
+									  pbufout, pbufoutlen, NULL);
+}
+
+int huffman_decode_memory64_ex(const unsigned char *bufin,
+							   uint64_t bufinlen,
+							   unsigned char **pbufout,
+							   uint64_t *pbufoutlen,
+							   const huffman_params *params)
+{
+	huffman_params defaults;
+	uint64_t data_count, njobs, i, pos;
+	unsigned char *buf;
+	decode_job *jobs;
+	int blocks, rc;
+
+	if(!params)
+	{
+		huffman_params_init(&defaults);
+		params = &defaults;
+	}
+
+	/* Ensure the arguments are valid. */
+	if(!pbufout || !pbufoutlen ||
+	   params->threads < 1 || params->threads > HUFFMAN_MAX_THREADS)
+		return 1;
+
+	/* With an index the blocks are decoded on all threads,
+	   each one straight into its place in the output. */
+	blocks = bufinlen > 0 && bufin[0] == HUFFMAN_FORMAT_BLOCKS;
+	if(blocks && read_block_index(bufin, bufinlen, &jobs, &njobs,
+								  &data_count) == 0)
+	{
+		buf = data_count > SIZE_MAX ? NULL :
+			(unsigned char*)malloc((size_t)data_count);
+		rc = !buf && data_count > 0;
+		for(i = 0, pos = 0; rc == 0 && i < njobs; pos += jobs[i].count, ++i)
+			jobs[i].out = buf + pos;
+		if(rc == 0)
+			rc = decode_jobs(jobs, njobs, params->threads);
+
+		free(jobs);
+		if(rc)
 		{
-			if(get_bit(bytes, curbit))
-			{
-				if(p->one == NULL)
-				{
-					p->one = curbit == (unsigned char)(numbits - 1)
-						? new_leaf_node(symbol)
-						: new_nonleaf_node(0, NULL, NULL);
-					p->one->parent = p;
-				}
-				p = p->one;
-			}
-			else
-			{
-				if(p->zero == NULL)
-				{
-					p->zero = curbit == (unsigned char)(numbits - 1)
-						? new_leaf_node(symbol)
-						: new_nonleaf_node(0, NULL, NULL);
-					p->zero->parent = p;
-				}
-				p = p->zero;
-			}
+			free(buf);
+			return 1;
 		}
-		
-		free(bytes);
+
+		*pbufout = buf;
+		*pbufoutlen = data_count;
+		return 0;
+	}
+
+	/* Get the size of the decoded data. */
+	if(blocks)
+		rc = decode_blocks(bufin, bufinlen, NULL, &data_count);
+	else
+		rc = read_image_count(bufin, bufinlen, &data_count);
+	if(rc || data_count > SIZE_MAX)
+		return 1;
+
+	buf = (unsigned char*)malloc((size_t)data_count);
+	if(!buf && data_count > 0)
+		return 1;
+
+	/* Decode the memory. */
+	if(blocks)
+		rc = decode_blocks(bufin, bufinlen, buf, &data_count);
+	else
+		rc = decode_image_speculative(bufin, bufinlen, buf, data_count,
+									  params->threads);
+	if(rc)
+	{
+		free(buf);
+		return 1;
 	}
 
-	return root;
+	*pbufout = buf;
+	*pbufoutlen = data_count;
+	return 0;
 }
 
+/*
+ * add_index_entry adds the entry of a block that starts at offset
+ * in the stream and at start in the decoded data to the index of
+ * nblocks entries at *pindex.
+ */
 static int
-do_memory_encode(buf_cache *pc,
-				 const unsigned char* bufin,
-				 unsigned int bufinlen,
-				 SymbolEncoder *se)
+add_index_entry(unsigned char **pindex,
+				uint64_t nblocks,
+				uint64_t offset,
+				uint64_t start)
 {
-	unsigned char curbyte = 0;
-	unsigned char curbit = 0;
-	unsigned int i;
-	
-	for(i = 0; i < bufinlen; ++i)
-	{
-		unsigned char uc = bufin[i];
-		huffman_code *code = (*se)[uc];
-		unsigned long i;
-		
-		for(i = 0; i < code->numbits; ++i)
-		{
-			/* Add the current bit to curbyte. */
-			curbyte |= get_bit(code->bits, i) << curbit;
+	unsigned char *tmp;
 
-			/* If this byte is filled up then write it
-			 * out and reset the curbit and curbyte. */
-			if(++curbit == 8)
-			{
-				if(write_cache(pc, &curbyte, sizeof(curbyte)))
-					return 1;
-				curbyte = 0;
-				curbit = 0;
-			}
+	if(nblocks >= SIZE_MAX / INDEX_ENTRY_SIZE - 2)
+		return 1;
+
+	tmp = (unsigned char*)realloc(*pindex,
+								  (size_t)(nblocks + 1) * INDEX_ENTRY_SIZE);
+	if(!tmp)
+		return 1;
+
+	*pindex = tmp;
+	store_be64(tmp + nblocks * INDEX_ENTRY_SIZE, offset);
+	store_be64(tmp + nblocks * INDEX_ENTRY_SIZE + 8, start);
+	return 0;
+}
+
+/*
+ * write_stream_end writes the block of length 0 that ends a
+ * HUFFMAN_FORMAT_BLOCKS stream. If pindex is not NULL the index
+ * of the nblocks blocks at *pindex follows it.
+ */
+static int
+write_stream_end(FILE *out,
+				 unsigned char **pindex,
+				 uint64_t nblocks,
+				 uint64_t total)
+{
+	uint32_t blocklen = 0;
+	unsigned char *tmp;
+	size_t len;
+
+	if(fwrite(&blocklen, 1, sizeof(blocklen), out) != sizeof(blocklen))
+		return 1;
+
+	if(!pindex)
+		return 0;
+
+	len = (size_t)nblocks * INDEX_ENTRY_SIZE;
+	tmp = (unsigned char*)realloc(*pindex, len + INDEX_TRAILER_SIZE);
+	if(!tmp)
+		return 1;
+
+	*pindex = tmp;
+	len += write_index_trailer(tmp + len, total, nblocks);
+	return fwrite(tmp, 1, len, out) != len;
+}
+
+int huffman_encode_file(FILE *in, FILE *out)
+{
+	return huffman_encode_file_ex(in, out, NULL);
+}
+
+/*
+ * huffman_encode_file_ex runs as a pipeline. A reader thread reads
+ * the input a block at a time into a ring of slots, the pool codes
+ * the blocks that have been read, each with its own code table, and
+ * a writer thread writes the coded blocks in the order they were
+ * read. The reader waits for the writer once every slot is in use,
+ * so no more than the ring of blocks and their encoded images is
+ * ever held in memory, and reading, coding and writing all go on at
+ * the same time.
+ */
+typedef struct encode_slot_tag
+{
+	unsigned char *buf;
+	size_t len;
+	unsigned char *image;
+	uint64_t imagelen;
+
+	/* Non-zero once image holds the coded block. */
+	int coded;
+} encode_slot;
+
+typedef struct encode_pipeline_tag
+{
+	pthread_mutex_t lock;
+
+	/* Broadcast whenever a block is read, coded or written, or
+	   when the input ends or an error stops the pipeline. */
+	pthread_cond_t changed;
+
+	FILE *in;
+	FILE *out;
+	const huffman_params *params;
+
+	/* Block k is held in slots[k % nslots]. */
+	encode_slot *slots;
+	unsigned int nslots;
+
+	/* The number of blocks read, handed out to be coded
+	   and written, and whether the input has ended. */
+	uint64_t nread;
+	uint64_t ncoding;
+	uint64_t nwritten;
+	int eof;
+
+	/* Non-zero once anything fails. Every stage stops then. */
+	int rc;
+
+	/* The index and the offsets of the next block in the stream
+	   and in the input, kept by the writer. */
+	unsigned char *index;
+	uint64_t offset;
+	uint64_t total;
+} encode_pipeline;
+
+static void *
+encode_pipeline_reader(void *arguments)
+{
+	encode_pipeline *p = (encode_pipeline *)arguments;
+	encode_slot *slot;
+	size_t len;
+
+	pthread_mutex_lock(&p->lock);
+	for(;;)
+	{
+		while(!p->rc && p->nread - p->nwritten >= p->nslots)
+			pthread_cond_wait(&p->changed, &p->lock);
+		if(p->rc)
+			break;
+
+		/* The slot is free, so it can be filled without the lock. */
+		slot = &p->slots[p->nread % p->nslots];
+		pthread_mutex_unlock(&p->lock);
+		len = fread(slot->buf, 1, p->params->block_size, p->in);
+		pthread_mutex_lock(&p->lock);
+
+		if(len == 0)
+		{
+			if(ferror(p->in))
+				p->rc = 1;
+			p->eof = 1;
+			pthread_cond_broadcast(&p->changed);
+			break;
 		}
+
+		slot->len = len;
+		++p->nread;
+		pthread_cond_broadcast(&p->changed);
 	}
+	pthread_mutex_unlock(&p->lock);
 
-	/*
-	 * If there is data in curbyte that has not been
-	 * output yet, which means that the last encoded
-	 * character did not fall on a byte boundary,
-	 * then output it.
-	 */
-	curbit > 0 ? write_cache(pc, &curbyte, sizeof(curbyte)) : 0;
-	
-	return (8 - curbit) % 8;
+	return NULL;
 }
 
-unsigned int merge_buffers(unsigned char **output,
-						   unsigned char **bufout_piece,
-						   unsigned int *bufout_piece_len,
-						   unsigned int *zeros)
+/*
+ * encode_pipeline_coder codes blocks as they are read until the
+ * input ends. Every thread of the pool runs one, and a thread that
+ * finds nothing left to code returns at once.
+ */
+static int
+encode_pipeline_coder(void *arguments, uint64_t unused)
 {
+	encode_pipeline *p = (encode_pipeline *)arguments;
+	encode_slot *slot;
+	int rc;
 
-	int i;
-	unsigned int size = 0;
-	unsigned int cur_len = 0;
-
-	unsigned char sel_mask[9];
-
-	/**
-	 * Little Endian
-	sel_mask[0] = 0x00;	sel_mask[1] = 0x80;
-	sel_mask[2] = 0xc0;	sel_mask[3] = 0xe0;
-	sel_mask[4] = 0xf0;	sel_mask[5] = 0xf8;
-	sel_mask[6] = 0xfc;	sel_mask[7] = 0xfe;
-	sel_mask[8] = 0xff; 
-	*/
-
-	// Big Endian
-	sel_mask[0] = 0x00;	sel_mask[1] = 0x01;
-	sel_mask[2] = 0x03;	sel_mask[3] = 0x07;
-	sel_mask[4] = 0x0f;	sel_mask[5] = 0x1f;
-	sel_mask[6] = 0x3f;	sel_mask[7] = 0x7f;
-	sel_mask[8] = 0xff;
-
-	for (i = 0; i < CORES; ++i) {
-		size += bufout_piece_len[i];
-	}
-
-	*output = malloc(size * sizeof(unsigned char));
-
-	memcpy(*output, bufout_piece[0], bufout_piece_len[0]);
-	cur_len += bufout_piece_len[0];
-
-	unsigned char bits;
-	unsigned int padding;
-	int kk;
-
-	for (kk = 1; kk < CORES; ++kk) {
-		if (zeros[kk - 1] != 0) { 
-			bits = sel_mask[zeros[kk-1]] & bufout_piece[kk][0];
-
-			(*output)[cur_len - 1] |= (bits << (8 - zeros[kk - 1]));
-
-			for (i = 0; i < bufout_piece_len[kk]; ++i) {
-				if (i == (bufout_piece_len[kk] - 1)) {
-					if (zeros[kk - 1] + zeros[kk] >= 8) {
-						bufout_piece_len[kk]--;
-						zeros[kk] = zeros[kk - 1] + zeros[kk] - 8;
-					} else {			
-						bufout_piece[kk][i] = bufout_piece[kk][i] >> zeros[kk - 1];
-						zeros[kk] += zeros[kk - 1];
-					}
-				} else {
-					padding = zeros[kk - 1];
-					bufout_piece[kk][i] >>= padding;
-					bits = sel_mask[padding] & bufout_piece[kk][i + 1];
-					bufout_piece[kk][i] |= (bits << (8 - padding));
-				}
-			}
-		}
-		
-		memcpy(*output + cur_len, bufout_piece[kk], bufout_piece_len[kk]);
-		cur_len += bufout_piece_len[kk];
+	(void)unused;
+	pthread_mutex_lock(&p->lock);
+	for(;;)
+	{
+		while(!p->rc && !p->eof && p->ncoding == p->nread)
+			pthread_cond_wait(&p->changed, &p->lock);
+		if(p->rc || p->ncoding == p->nread)
+			break;
+
+		slot = &p->slots[p->ncoding++ % p->nslots];
+		pthread_mutex_unlock(&p->lock);
+		rc = encode_image(slot->buf, slot->len, &slot->image,
+						  &slot->imagelen, p->params);
+		pthread_mutex_lock(&p->lock);
+
+		p->rc |= rc;
+		slot->coded = 1;
+		pthread_cond_broadcast(&p->changed);
 	}
+	pthread_mutex_unlock(&p->lock);
 
-	return cur_len;
+	return 0;
 }
 
-int huffman_encode_memory(const unsigned char *bufin,
-						  unsigned int bufinlen,
-						  unsigned char **pbufout,
-						  unsigned int *pbufoutlen)
+static void *
+encode_pipeline_writer(void *arguments)
 {
-	SymbolFrequencies sf;
-	SymbolEncoder *se;
-	huffman_node *root = NULL;
-	int rc, i;
-	unsigned int symbol_count;
-	buf_cache cache;
+	encode_pipeline *p = (encode_pipeline *)arguments;
+	encode_slot *slot;
+	uint32_t blocklen;
+	int rc;
+
+	pthread_mutex_lock(&p->lock);
+	for(;;)
+	{
+		slot = &p->slots[p->nwritten % p->nslots];
+		while(!p->rc && !(p->nwritten < p->nread && slot->coded) &&
+			  !(p->eof && p->nwritten == p->nread))
+			pthread_cond_wait(&p->changed, &p->lock);
+		if(p->rc || p->nwritten == p->nread)
+			break;
+		pthread_mutex_unlock(&p->lock);
+
+		/* Write the length of the block in network byte order,
+		   then the block. */
+		blocklen = htonl((uint32_t)slot->imagelen);
+		rc = (p->params->block_index &&
+			  add_index_entry(&p->index, p->nwritten, p->offset, p->total)) ||
+			fwrite(&blocklen, 1, sizeof(blocklen), p->out) != sizeof(blocklen) ||
+			fwrite(slot->image, 1, (size_t)slot->imagelen, p->out) != slot->imagelen;
+		p->offset += sizeof(blocklen) + slot->imagelen;
+		p->total += slot->len;
+		free(slot->image);
+		slot->image = NULL;
+
+		pthread_mutex_lock(&p->lock);
+		p->rc |= rc;
+		slot->coded = 0;
+		++p->nwritten;
+		pthread_cond_broadcast(&p->changed);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
 
-	buf_cache cache_tid[CORES];
-	unsigned char* _bufout[CORES];
-	unsigned int _bufoutlen[CORES];
-	unsigned int remains[CORES];
+int huffman_encode_file_ex(FILE *in, FILE *out, const huffman_params *params)
+{
+	huffman_params defaults;
+	unsigned char version = HUFFMAN_FORMAT_BLOCKS;
+	encode_pipeline p;
+	pthread_t reader, writer;
+	int reading = 0, writing = 0;
+	unsigned int i;
+
+	if(!params)
+	{
+		huffman_params_init(&defaults);
+		params = &defaults;
+	}
 
 	/* Ensure the arguments are valid. */
-	if(!pbufout || !pbufoutlen)
+	if(!in || !out || params->max_bits < 1 ||
+	   params->max_bits > HUFFMAN_MAX_CODE_BITS ||
+	   params->streams < 1 || params->streams > HUFFMAN_MAX_STREAMS ||
+	   params->threads < 1 || params->threads > HUFFMAN_MAX_THREADS ||
+	   params->block_size < 1 ||
+	   params->block_size > HUFFMAN_MAX_BLOCK_SIZE)
 		return 1;
 
-	if(init_cache(&cache, CACHE_SIZE, pbufout, pbufoutlen))
+	/* Two slots per thread let the reader and the writer work on
+	   one set of blocks while the threads code the other. */
+	memset(&p, 0, sizeof(p));
+	p.in = in;
+	p.out = out;
+	p.params = params;
+	p.nslots = 2 * params->threads;
+	p.offset = 1;
+	p.slots = (encode_slot*)calloc(p.nslots, sizeof(*p.slots));
+	if(!p.slots)
 		return 1;
 
-	pthread_t threads[CORES] = {0};
-	
-	struct cache_struct arguments_1[CORES];
-	struct block_encode_struct arguments_2[CORES];
+	for(i = 0; i < p.nslots; ++i)
+	{
+		p.slots[i].buf = (unsigned char*)malloc(params->block_size);
+		if(!p.slots[i].buf)
+			p.rc = 1;
+	}
 
-	/**
-	 * Init cache for every thread
-	 */
-	for (i = 0; i < CORES; ++i) {
+	if(fwrite(&version, 1, sizeof(version), out) != sizeof(version))
+		p.rc = 1;
 
-		arguments_1[i].cache_tid = &cache_tid[i];
-		arguments_1[i]._bufout = &_bufout[i];
-		arguments_1[i]._bufoutlen = &_bufoutlen[i];
-		
-		if ( pthread_create(&threads[i], NULL, init_cache_for_threads, (void *)&arguments_1[i]) ) {
-	         fprintf(stderr, "Error creating threads\n");
-	         return -1;
-	    }
-	}
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.changed, NULL);
 
-	for (i = 0; i < CORES; ++i) {
-		if ( pthread_join(threads[i], NULL) ) {
-	          fprintf(stderr, "Error joining threads\n");
-	          return -1;
-	    }
-	}	
+	if(p.rc == 0)
+	{
+		reading = !pthread_create(&reader, NULL, encode_pipeline_reader, &p);
+		writing = reading &&
+			!pthread_create(&writer, NULL, encode_pipeline_writer, &p);
+
+		pthread_mutex_lock(&p.lock);
+		if(!reading || !writing)
+			p.rc = 1;
+		pthread_cond_broadcast(&p.changed);
+		pthread_mutex_unlock(&p.lock);
+
+		huffman_run_parallel(params->threads, params->threads,
+							 encode_pipeline_coder, &p);
+		if(reading)
+			pthread_join(reader, NULL);
+		if(writing)
+			pthread_join(writer, NULL);
+	}
 
-	/* Get the frequency of each symbol in the input memory. */
-	symbol_count = get_symbol_frequencies_from_memory(&sf, bufin, bufinlen);
+	/* A block of length 0 ends the stream. */
+	if(p.rc == 0 &&
+	   write_stream_end(out, params->block_index ? &p.index : NULL,
+						p.nwritten, p.total))
+		p.rc = 1;
 
-	/* Build an optimal table from the symbolCount. */
-	se = calculate_huffman_codes(&sf);
-	root = sf[0];
-
-	/* Scan the memory again and, using the table
-	   previously built, encode it into the output memory. */
-	rc = write_code_table_to_memory(&cache, se, symbol_count);
-	flush_cache(&cache);
-	if(rc == 0) {
-
-		for (i = 0; i < CORES; ++i) {
-
-			arguments_2[i].cache_tid = arguments_1[i].cache_tid;
-			arguments_2[i].bufin = &bufin;
-			arguments_2[i].bufinlen = &bufinlen;
-			arguments_2[i].se = &se;
-			arguments_2[i].pos = i;
-
-			if ( pthread_create(&threads[i], NULL, do_memory_encode_threads, (void *)&arguments_2[i]) ) {
-		         fprintf(stderr, "Error creating threads\n");
-		         return -1;
-		    }
-		}
+	pthread_cond_destroy(&p.changed);
+	pthread_mutex_destroy(&p.lock);
+	for(i = 0; i < p.nslots; ++i)
+	{
+		free(p.slots[i].buf);
+		free(p.slots[i].image);
+	}
+	free(p.slots);
+	free(p.index);
+	return p.rc;
+}
 
-		for (i = 0; i < CORES; ++i) {
-			if ( pthread_join(threads[i], NULL) ) {
-	          fprintf(stderr, "Error joining threads\n");
-	          return -1;
-	    	}
-		}
+/*
+ * decode_whole_file reads all of in into memory and decodes
+ * it with huffman_decode_memory. The formats that are a single
+ * image cannot be decoded in pieces.
+ */
+static int
+decode_whole_file(FILE *in, FILE *out, const huffman_params *params)
+{
+	unsigned char *buf = NULL, *bufout = NULL;
+	size_t len = 0, cur = 0;
+	uint64_t bufoutlen = 0;
+	int rc;
 
-			for (i = 0; i < CORES; ++i)
+	/* Read the file into memory, doubling the buffer as it fills. */
+	while(!feof(in) && !ferror(in))
+	{
+		if(cur == len)
+		{
+			unsigned char *tmp;
+			len = len ? len * 2 : 1024;
+			tmp = (unsigned char*)realloc(buf, len);
+			if(!tmp)
 			{
-				remains[i] = arguments_2[i].remains;
+				free(buf);
+				return 1;
 			}
+			buf = tmp;
+		}
+
+		cur += fread(buf + cur, 1, len - cur, in);
 	}
 
-	unsigned int tmp_size = *pbufoutlen;
+	rc = ferror(in) ||
+		huffman_decode_memory64_ex(buf, cur, &bufout, &bufoutlen, params);
+	free(buf);
+	if(rc)
+		return 1;
 
-	for (i = 0; i < CORES; ++i) {
-		tmp_size += _bufoutlen[i];
-	}
-	
-	unsigned char *tmp = realloc(*pbufout, tmp_size * sizeof(char));
+	/* Write the memory to the file. */
+	rc = fwrite(bufout, 1, bufoutlen, out) != bufoutlen;
+	free(bufout);
+	return rc;
+}
 
-	unsigned char *aux;
+/*
+ * grow_buffer makes the buffer at *pbuf, which is *plen bytes
+ * long, at least len bytes long.
+ */
+static int
+grow_buffer(unsigned char **pbuf, uint64_t *plen, uint64_t len)
+{
+	unsigned char *tmp;
 
-	unsigned int res = merge_buffers(&aux, _bufout, _bufoutlen, remains);
+	if(len <= *plen)
+		return 0;
 
-	memcpy(tmp + *pbufoutlen, aux, res);
+	tmp = (unsigned char*)realloc(*pbuf, (size_t)len);
+	if(!tmp)
+		return 1;
 
-	*pbufout = tmp;
-	*pbufoutlen += res;
-	
-	/* Free the Huffman tree. */
-	free_huffman_tree(root);
-	free_encoder(se);
-	free_cache(&cache);
+	*pbuf = tmp;
+	*plen = len;
 	return 0;
 }
 
-int huffman_decode_memory(const unsigned char *bufin,
-						  unsigned int bufinlen,
-						  unsigned char **pbufout,
-						  unsigned int *pbufoutlen)
+int huffman_decode_file(FILE *in, FILE *out)
 {
-	huffman_node *root, *p;
-	unsigned int data_count;
-	unsigned int i = 0;
-	unsigned char *buf;
-	unsigned int bufcur = 0;
+	return huffman_decode_file_ex(in, out, NULL);
+}
+
+int huffman_decode_file_ex(FILE *in, FILE *out, const huffman_params *params)
+{
+	huffman_params defaults;
+	unsigned char **bufs, **bufouts;
+	uint64_t *buflens, *bufoutlens;
+	decode_job *jobs;
+	uint32_t blocklen;
+	uint64_t count;
+	unsigned int n, k;
+	int c, done = 0, rc = 0;
+
+	if(!params)
+	{
+		huffman_params_init(&defaults);
+		params = &defaults;
+	}
 
 	/* Ensure the arguments are valid. */
-	if(!pbufout || !pbufoutlen) {
+	if(!in || !out ||
+	   params->threads < 1 || params->threads > HUFFMAN_MAX_THREADS)
 		return 1;
-	}
 
-	/* Read the Huffman code table. */
-	root = read_code_table_from_memory(bufin, bufinlen, &i, &data_count);
-	if(!root) {
+	c = fgetc(in);
+	if(c == EOF)
 		return 1;
-	}
 
-	buf = (unsigned char*)malloc(data_count);
+	if(c != HUFFMAN_FORMAT_BLOCKS)
+	{
+		ungetc(c, in);
+		return decode_whole_file(in, out, params);
+	}
 
-	/* Decode the memory. */
-	p = root;
-	for(; i < bufinlen && data_count > 0; ++i) 
+	bufs = (unsigned char**)calloc(params->threads, sizeof(*bufs));
+	bufouts = (unsigned char**)calloc(params->threads, sizeof(*bufouts));
+	buflens = (uint64_t*)calloc(params->threads, sizeof(*buflens));
+	bufoutlens = (uint64_t*)calloc(params->threads, sizeof(*bufoutlens));
+	jobs = (decode_job*)malloc(params->threads * sizeof(*jobs));
+	if(!bufs || !bufouts || !buflens || !bufoutlens || !jobs)
+		rc = 1;
+
+	/* Read a block for each thread at a time and decode them in
+	   parallel, reusing the buffers. Whatever follows the block of
+	   length 0, such as an index, is not read. */
+	while(rc == 0 && !done)
 	{
-		unsigned char byte = bufin[i];
-		unsigned char mask = 1;
-		while(data_count > 0 && mask)
+		for(n = 0; n < params->threads; ++n)
 		{
-			p = byte & mask ? p->one : p->zero;
-			mask <<= 1;
+			if(fread(&blocklen, 1, sizeof(blocklen), in) != sizeof(blocklen))
+			{
+				rc = 1;
+				break;
+			}
 
-			if(p->isLeaf)
+			blocklen = ntohl(blocklen);
+			if(blocklen == 0)
 			{
-				buf[bufcur++] = p->symbol;
-				p = root;
-				--data_count;
+				done = 1;
+				break;
 			}
+
+			if(blocklen > MAX_BLOCK_IMAGE_SIZE ||
+			   grow_buffer(&bufs[n], &buflens[n], blocklen) ||
+			   fread(bufs[n], 1, blocklen, in) != blocklen ||
+			   read_image_count(bufs[n], blocklen, &count) ||
+			   count > HUFFMAN_MAX_BLOCK_SIZE ||
+			   grow_buffer(&bufouts[n], &bufoutlens[n], count))
+			{
+				rc = 1;
+				break;
+			}
+
+			jobs[n].image = bufs[n];
+			jobs[n].len = blocklen;
+			jobs[n].out = bufouts[n];
+			jobs[n].count = count;
+		}
+
+		if(rc == 0)
+			rc = decode_jobs(jobs, n, params->threads);
+
+		for(k = 0; rc == 0 && k < n; ++k)
+		{
+			if(fwrite(jobs[k].out, 1, (size_t)jobs[k].count, out) != jobs[k].count)
+				rc = 1;
 		}
 	}
 
-	free_huffman_tree(root);
-	*pbufout = buf;
-	*pbufoutlen = bufcur;
-	return 0;
+	for(k = 0; bufs && bufouts && k < params->threads; ++k)
+	{
+		free(bufs[k]);
+		free(bufouts[k]);
+	}
+	free(bufs);
+	free(bufouts);
+	free(buflens);
+	free(bufoutlens);
+	free(jobs);
+	return rc;
 }
@@ -19,7 +19,8 @@ extern char* optarg;
 #include <unistd.h>
 #endif
 
-static int memory_encode_file(FILE *in, FILE *out);
+static int memory_encode_file(FILE *in, FILE *out,
+							  const huffman_params *params);
 static int memory_decode_file(FILE *in, FILE *out);
 
 static void
@@ -34,11 +35,16 @@ version(FILE *out)
 static void
 usage(FILE* out)
 {
-	fputs("Usage: huffcode [-i<input file>] [-o<output file>] [-d|-c]\n"
+	fputs("Usage: huffcode [-i<input file>] [-o<output file>] [-d|-c]"
+		  " [-b<bits>] [-s<streams>] [-x]\n"
 		  "-i - input file (default is standard input)\n"
 		  "-o - output file (default is standard output)\n"
 		  "-d - decompress\n"
 		  "-c - compress (default)\n"
+		  "-b - longest code in bits when compressing (default 32)\n"
+		  "-s - bitstreams per block when compressing, for faster decoding"
+		  " (default 1)\n"
+		  "-x - index the blocks when compressing, for parallel decoding\n"
 		  "-m - read file into memory, compress, then write to file (not default)\n",
 		  out);
 }
@@ -46,15 +52,18 @@ usage(FILE* out)
 int
 main(int argc, char** argv)
 {
-	char memory = 1;
+	char memory = 0;
 	char compress = 1;
 	int opt;
 	const char *file_in = NULL, *file_out = NULL;
 	FILE *in = stdin;
 	FILE *out = stdout;
+	huffman_params params;
+
+	huffman_params_init(&params);
 
 	/* Get the command line arguments. */
-	while((opt = getopt(argc, argv, "i:o:cdhvm")) != -1)
+	while((opt = getopt(argc, argv, "i:o:cdhvmb:s:x")) != -1)
 	{
 		switch(opt)
 		{
@@ -70,6 +79,30 @@ main(int argc, char** argv)
 		case 'd':
 			compress = 0;
 			break;
+		case 'm':
+			memory = 1;
+			break;
+		case 'x':
+			params.block_index = 1;
+			break;
+		case 'b':
+			params.max_bits = (unsigned int)atoi(optarg);
+			if(params.max_bits < 1 || params.max_bits > HUFFMAN_MAX_CODE_BITS)
+			{
+				fprintf(stderr, "Code length must be from 1 to %d bits\n",
+						HUFFMAN_MAX_CODE_BITS);
+				return 1;
+			}
+			break;
+		case 's':
+			params.streams = (unsigned int)atoi(optarg);
+			if(params.streams < 1 || params.streams > HUFFMAN_MAX_STREAMS)
+			{
+				fprintf(stderr, "Streams must be from 1 to %d\n",
+						HUFFMAN_MAX_STREAMS);
+				return 1;
+			}
+			break;
 		case 'h':
 			usage(stdout);
 			return 0;
@@ -111,15 +144,19 @@ main(int argc, char** argv)
 	if(memory)
 	{
 		return compress ?
-			memory_encode_file(in, out) : memory_decode_file(in, out);
+			memory_encode_file(in, out, &params) : memory_decode_file(in, out);
 	}
+
+	return compress ?
+		huffman_encode_file_ex(in, out, &params) : huffman_decode_file(in, out);
 }
 
 static int
-memory_encode_file(FILE *in, FILE *out)
+memory_encode_file(FILE *in, FILE *out, const huffman_params *params)
 {
 	unsigned char *buf = NULL, *bufout = NULL;
-	unsigned int len = 0, cur = 0, inc = 1024, bufoutlen = 0;
+	size_t len = 0, cur = 0, inc = 1024;
+	uint64_t bufoutlen = 0;
 
 	assert(in && out);
 
@@ -144,7 +181,7 @@ memory_encode_file(FILE *in, FILE *out)
 		return 1;
 
 	/* Encode the memory. */
-	if(huffman_encode_memory(buf, cur, &bufout, &bufoutlen))
+	if(huffman_encode_memory64_ex(buf, cur, &bufout, &bufoutlen, params))
 	{
 		free(buf);
 		return 1;
@@ -153,7 +190,7 @@ memory_encode_file(FILE *in, FILE *out)
 	free(buf);
 
 	/* Write the memory to the file. */
-	if(fwrite(bufout, 1, bufoutlen, out) != bufoutlen)
+	if(fwrite(bufout, 1, (size_t)bufoutlen, out) != bufoutlen)
 	{
 		free(bufout);
 		return 1;
@@ -168,7 +205,8 @@ static int
 memory_decode_file(FILE *in, FILE *out)
 {
 	unsigned char *buf = NULL, *bufout = NULL;
-	unsigned int len = 0, cur = 0, inc = 1024, bufoutlen = 0;
+	size_t len = 0, cur = 0, inc = 1024;
+	uint64_t bufoutlen = 0;
 	assert(in && out);
 
 	/* Read the file into memory. */
@@ -192,7 +230,7 @@ memory_decode_file(FILE *in, FILE *out)
 		return 1;
 
 	/* Decode the memory. */
-	if(huffman_decode_memory(buf, cur, &bufout, &bufoutlen))
+	if(huffman_decode_memory64(buf, cur, &bufout, &bufoutlen))
 	{
 		free(buf);
 		return 1;
@@ -201,7 +239,7 @@ memory_decode_file(FILE *in, FILE *out)
 	free(buf);
 
 	/* Write the memory to the file. */
-	if(fwrite(bufout, 1, bufoutlen, out) != bufoutlen)
+	if(fwrite(bufout, 1, (size_t)bufoutlen, out) != bufoutlen)
 	{
 		free(bufout);
 		return 1;
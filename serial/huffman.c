@@ -12,41 +12,20 @@
 
 #ifdef WIN32
 #include <winsock2.h>
-#include <malloc.h>
-#define alloca _alloca
 #else
 #include <netinet/in.h>
 #endif
 
 typedef struct huffman_node_tag
 {
-	unsigned char isLeaf;
-	unsigned long count;
-	struct huffman_node_tag *parent;
+	uint64_t count;
 
-	union
-	{
-		struct
-		{
-			struct huffman_node_tag *zero, *one;
-		};
-		unsigned char symbol;
-	};
+	/* The two subsets of a set, as indexes into the nodes
+	   of its huffman_tree. Both are NO_NODE for a leaf. */
+	uint16_t zero, one;
+	unsigned char symbol;
 } huffman_node;
 
-typedef struct huffman_code_tag
-{
-	/* The length of this code in bits. */
-	unsigned long numbits;
-
-	/* The bits that make up this code. The first
-	   bit is at position 0 in bits[0]. The second
-	   bit is at position 1 in bits[0]. The eighth
-	   bit is at position 7 in bits[0]. The ninth
-	   bit is at position 0 in bits[1]. */
-	unsigned char *bits;
-} huffman_code;
-
 static unsigned long
 numbytes_from_numbits(unsigned long numbits)
 {
@@ -63,335 +42,414 @@ get_bit(unsigned char* bits, unsigned long i)
 	return (bits[i / 8] >> i % 8) & 1;
 }
 
-static void
-reverse_bits(unsigned char* bits, unsigned long numbits)
-{
-	unsigned long numbytes = numbytes_from_numbits(numbits);
-	unsigned char *tmp =
-	    (unsigned char*)alloca(numbytes);
-	unsigned long curbit;
-	long curbyte = 0;
-	
-	memset(tmp, 0, numbytes);
+#define MAX_SYMBOLS 256
 
-	for(curbit = 0; curbit < numbits; ++curbit)
-	{
-		unsigned int bitpos = curbit % 8;
+/* The longest code the decoder's bit buffer is guaranteed to hold. */
+#define MAX_CODE_BITS 56
 
-		if(curbit > 0 && curbit % 8 == 0)
-			++curbyte;
-		
-		tmp[curbyte] |= (get_bit(bits, numbits - curbit - 1) << bitpos);
-	}
+/*
+ * The first byte of the encoded memory is the format version. The
+ * legacy format starts with the number of code table entries as a
+ * 32-bit big endian value, so its first byte is always 0.
+ */
+#define HUFFMAN_FORMAT_LEGACY 0
+#define HUFFMAN_FORMAT_V1 1
 
-	memcpy(bits, tmp, numbytes);
-}
+/*
+ * A stream of independently coded blocks, as written by
+ * huffman_encode_file. After the version byte, each block is
+ * its length as a 32-bit big endian value followed by a V1
+ * image of up to HUFFMAN_MAX_BLOCK_SIZE bytes of input. A
+ * length of 0 ends the stream.
+ */
+#define HUFFMAN_FORMAT_BLOCKS 2
 
 /*
- * new_code builds a huffman_code from a leaf in
- * a Huffman tree.
+ * V1 with the number of bytes encoded stored as a 64-bit big
+ * endian value. It is only written when the count does not fit
+ * in 32 bits, so smaller inputs still produce V1.
  */
-static huffman_code*
-new_code(const huffman_node* leaf)
-{
-	/* Build the huffman code by walking up to
-	 * the root node and then reversing the bits,
-	 * since the Huffman code is calculated by
-	 * walking down the tree. */
-	unsigned long numbits = 0;
-	unsigned char* bits = NULL;
-	huffman_code *p;
+#define HUFFMAN_FORMAT_V2 3
 
-	while(leaf && leaf->parent)
-	{
-		huffman_node *parent = leaf->parent;
-		unsigned char cur_bit = (unsigned char)(numbits % 8);
-		unsigned long cur_byte = numbits / 8;
+/*
+ * A HUFFMAN_FORMAT_BLOCKS stream may carry an index of its blocks
+ * after the block of length 0. For every block it holds the offset
+ * of the block's length in the stream and the offset of its first
+ * byte in the decoded data. The decoded length, the number of
+ * blocks and INDEX_MAGIC follow. The numbers are 64-bit big endian.
+ * Readers that stop at the block of length 0 never see the index.
+ */
+#define INDEX_MAGIC "HIDX"
+#define INDEX_ENTRY_SIZE 16
+#define INDEX_TRAILER_SIZE 20
 
-		/* If we need another byte to hold the code,
-		   then allocate it. */
-		if(cur_bit == 0)
-		{
-			size_t newSize = cur_byte + 1;
-			bits = (unsigned char*)realloc(bits, newSize);
-			bits[newSize - 1] = 0; /* Initialize the new byte. */
-		}
+/* Header flags. */
+#define HUFFMAN_FLAG_NIBBLES 0x01
 
-		/* If a one must be added then or it in. If a zero
-		 * must be added then do nothing, since the byte
-		 * was initialized to zero. */
-		if(leaf == parent->one)
-			bits[cur_byte] |= 1 << cur_bit;
+/*
+ * The data is split into several bitstreams. The code lengths are
+ * followed by the number of streams in a byte and the length in
+ * bytes of every stream but the last as a 64-bit big endian value.
+ * Symbol i is coded in stream i % streams, and the streams follow
+ * each other, each starting on a byte boundary.
+ */
+#define HUFFMAN_FLAG_STREAMS 0x02
 
-		++numbits;
-		leaf = parent;
-	}
+/* The header is at most 12 bytes, a byte per symbol
+   and the stream lengths. */
+#define MAX_HEADER_SIZE \
+	(12 + MAX_SYMBOLS + 1 + 8 * (HUFFMAN_MAX_STREAMS - 1))
 
-	if(bits)
-		reverse_bits(bits, numbits);
+/* The longest block image: the header, the longest code for
+   every byte of the largest block and the partly used last byte
+   of every stream. */
+#define MAX_BLOCK_IMAGE_SIZE \
+	(MAX_HEADER_SIZE + HUFFMAN_MAX_BLOCK_SIZE / 8 * HUFFMAN_MAX_CODE_BITS + \
+	 HUFFMAN_MAX_STREAMS)
 
-	p = (huffman_code*)malloc(sizeof(huffman_code));
-	p->numbits = numbits;
-	p->bits = bits;
-	return p;
-}
+typedef uint64_t SymbolFrequencies[MAX_SYMBOLS];
 
-#define MAX_SYMBOLS 256
-typedef huffman_node* SymbolFrequencies[MAX_SYMBOLS];
-typedef huffman_code* SymbolEncoder[MAX_SYMBOLS];
+/* A tree with a leaf for each of n symbols has 2n - 1 nodes. */
+#define MAX_NODES (2 * MAX_SYMBOLS - 1)
 
-static huffman_node*
-new_leaf_node(unsigned char symbol)
+/* The index of a subset that is not there. */
+#define NO_NODE 0xffff
+
+/*
+ * huffman_tree holds every node of a Huffman tree in one array,
+ * linked by index. The leaves come first, sorted by count, and
+ * are followed by the sets in the order they are merged, so a
+ * set always comes after its subsets and the root is last.
+ */
+typedef struct huffman_tree_tag
 {
-	huffman_node *p = (huffman_node*)malloc(sizeof(huffman_node));
-	p->isLeaf = 1;
-	p->symbol = symbol;
-	p->count = 0;
-	p->parent = 0;
-	return p;
-}
+	huffman_node nodes[MAX_NODES];
+	unsigned int nleaves;
+	unsigned int nnodes;
+} huffman_tree;
 
-static huffman_node*
-new_nonleaf_node(unsigned long count, huffman_node *zero, huffman_node *one)
+/*
+ * SymbolEncoder holds the code of every symbol in flat
+ * tables indexed by symbol value. A symbol that does not
+ * occur has a length of 0.
+ */
+typedef struct symbol_encoder_tag
 {
-	huffman_node *p = (huffman_node*)malloc(sizeof(huffman_node));
-	p->isLeaf = 0;
-	p->count = count;
-	p->zero = zero;
-	p->one = one;
-	p->parent = 0;
-	
-	return p;
-}
+	/* The bits that make up each code, shifted so that
+	   the first bit to be written is at position 0. */
+	uint32_t code[MAX_SYMBOLS];
+
+	/* The length of each code in bits. */
+	unsigned char len[MAX_SYMBOLS];
+} SymbolEncoder;
 
 static void
-free_huffman_tree(huffman_node *subtree)
+free_encoder(SymbolEncoder *pSE)
 {
-	if(subtree == NULL)
-		return;
-
-	if(!subtree->isLeaf)
-	{
-		free_huffman_tree(subtree->zero);
-		free_huffman_tree(subtree->one);
-	}
-	
-	free(subtree);
+	free(pSE);
 }
 
 static void
-free_code(huffman_code* p)
+init_frequencies(SymbolFrequencies *pSF)
 {
-	free(p->bits);
-	free(p);
+	memset(*pSF, 0, sizeof(SymbolFrequencies));
 }
 
+/*
+ * The counts go into HISTOGRAM_WAYS sub-histograms, consecutive
+ * bytes into different ones, so that a run of the same byte does
+ * not have to wait for the store of one count before the next.
+ * The 32-bit sub-histograms are added into the 64-bit totals every
+ * HISTOGRAM_CHUNK bytes, before any of them can overflow.
+ */
+#define HISTOGRAM_WAYS 4
+#define HISTOGRAM_CHUNK (1u << 30)
+
+/*
+ * count_bytes adds the bytes of bufin to the sub-histograms. The
+ * input is read 8 bytes at a time; the order of the bytes within a
+ * word does not matter for the counts.
+ */
 static void
-free_encoder(SymbolEncoder *pSE)
+count_bytes(uint32_t counts[HISTOGRAM_WAYS][MAX_SYMBOLS],
+			const unsigned char *bufin,
+			uint64_t bufinlen)
 {
-	unsigned long i;
-	for(i = 0; i < MAX_SYMBOLS; ++i)
+	const unsigned char *end = bufin + bufinlen;
+	uint64_t w;
+
+	while(end - bufin >= 8)
 	{
-		huffman_code *p = (*pSE)[i];
-		if(p)
-			free_code(p);
+		memcpy(&w, bufin, sizeof(w));
+		bufin += 8;
+		++counts[0][w & 0xff];
+		++counts[1][(w >> 8) & 0xff];
+		++counts[2][(w >> 16) & 0xff];
+		++counts[3][(w >> 24) & 0xff];
+		++counts[0][(w >> 32) & 0xff];
+		++counts[1][(w >> 40) & 0xff];
+		++counts[2][(w >> 48) & 0xff];
+		++counts[3][w >> 56];
 	}
 
-	free(pSE);
+	while(bufin < end)
+		++counts[0][*bufin++];
 }
 
-static void
-init_frequencies(SymbolFrequencies *pSF)
+static uint64_t
+get_symbol_frequencies_from_memory(SymbolFrequencies *pSF,
+								   const unsigned char *bufin,
+								   uint64_t bufinlen)
 {
-	memset(*pSF, 0, sizeof(SymbolFrequencies));
+	uint32_t counts[HISTOGRAM_WAYS][MAX_SYMBOLS];
+	uint64_t i, len;
+	unsigned int j, k;
+
+	/* Set all frequencies to 0. */
+	init_frequencies(pSF);
+
+	/* Count the frequency of each symbol in the input file. */
+	for(i = 0; i < bufinlen; i += len)
+	{
+		len = bufinlen - i < HISTOGRAM_CHUNK ? bufinlen - i : HISTOGRAM_CHUNK;
+		memset(counts, 0, sizeof(counts));
+		count_bytes(counts, bufin + i, len);
+		for(k = 0; k < HISTOGRAM_WAYS; ++k)
+		{
+			for(j = 0; j < MAX_SYMBOLS; ++j)
+				(*pSF)[j] += counts[k][j];
+		}
+	}
+
+	return bufinlen;
 }
 
-typedef struct buf_cache_tag
+/*
+ * When used by qsort, SFComp sorts the leaves so that
+ * the symbol with the lowest frequency is first, and
+ * symbols of equal frequency by symbol value.
+ */
+static int
+SFComp(const void *p1, const void *p2)
 {
-	unsigned char *cache;
-	unsigned int cache_len;
-	unsigned int cache_cur;
-	unsigned char **pbufout;
-	unsigned int *pbufoutlen;
-} buf_cache;
+	const huffman_node *hn1 = (const huffman_node*)p1;
+	const huffman_node *hn2 = (const huffman_node*)p2;
 
-static int init_cache(buf_cache* pc,
-					  unsigned int cache_size,
-					  unsigned char **pbufout,
-					  unsigned int *pbufoutlen)
-{
-	assert(pc && pbufout && pbufoutlen);
-	if(!pbufout || !pbufoutlen)
+	if(hn1->count > hn2->count)
 		return 1;
-	
-	pc->cache = (unsigned char*)malloc(cache_size);
-	pc->cache_len = cache_size;
-	pc->cache_cur = 0;
-	pc->pbufout = pbufout;
-	*pbufout = NULL;
-	pc->pbufoutlen = pbufoutlen;
-	*pbufoutlen = 0;
+	else if(hn1->count < hn2->count)
+		return -1;
 
-	return pc->cache ? 0 : 1;
+	return (int)hn1->symbol - (int)hn2->symbol;
 }
 
-static void free_cache(buf_cache* pc)
+/*
+ * pop_least removes and returns the index of the node with the
+ * least count from the front of either the sorted leaves or the
+ * merged sets, which are created in order of count. A leaf wins
+ * a tie.
+ */
+static unsigned int
+pop_least(const huffman_tree *tree, unsigned int *pleaf, unsigned int *phead)
 {
-	assert(pc);
-	if(pc->cache)
-	{
-		free(pc->cache);
-		pc->cache = NULL;
-	}
+	if(*pleaf < tree->nleaves &&
+	   (*phead == tree->nnodes ||
+		tree->nodes[*pleaf].count <= tree->nodes[*phead].count))
+		return (*pleaf)++;
+
+	return (*phead)++;
 }
 
-static int flush_cache(buf_cache* pc)
+
+/*
+ * get_code_lengths records the depth of each leaf of the
+ * Huffman tree as the code length of its symbol. A set comes
+ * after its subsets, so walking back from the root reaches
+ * every node after its parent.
+ */
+static void
+get_code_lengths(const huffman_tree *tree, unsigned int *lengths)
 {
-	assert(pc);
-	
-	if(pc->cache_cur > 0)
-	{
-		unsigned int newlen = pc->cache_cur + *pc->pbufoutlen;
-		unsigned char* tmp = realloc(*pc->pbufout, newlen);
-		if(!tmp)
-			return 1;
+	unsigned char depth[MAX_NODES];
+	unsigned int i;
+
+	if(tree->nnodes == 0)
+		return;
 
-		memcpy(tmp + *pc->pbufoutlen, pc->cache, pc->cache_cur);
+	depth[tree->nnodes - 1] = 0;
+	for(i = tree->nnodes; i-- > 0; )
+	{
+		const huffman_node *p = &tree->nodes[i];
 
-		*pc->pbufout = tmp;
-		*pc->pbufoutlen = newlen;
-		pc->cache_cur = 0;
+		if(p->zero == NO_NODE)
+			lengths[p->symbol] = depth[i];
+		else
+			depth[p->zero] = depth[p->one] = depth[i] + 1;
 	}
-
-	return 0;
 }
 
-static int write_cache(buf_cache* pc,
-					   const void *to_write,
-					   unsigned int to_write_len)
+/*
+ * assign_canonical_codes gives every symbol with a nonzero
+ * length its canonical code. Shorter codes come first and codes
+ * of the same length are consecutive in symbol order, so the
+ * lengths alone determine the codes. Each code is stored bit
+ * reversed, with the first bit to be written at position 0.
+ * The lengths must not exceed MAX_CODE_BITS.
+ */
+static void
+assign_canonical_codes(const unsigned char *lengths, uint64_t *codes)
 {
-	unsigned char* tmp;
+	uint64_t next_code[MAX_CODE_BITS + 1];
+	unsigned int bl_count[MAX_CODE_BITS + 1];
+	uint64_t code = 0;
+	unsigned int i, j;
+
+	memset(bl_count, 0, sizeof(bl_count));
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+		++bl_count[lengths[i]];
+	bl_count[0] = 0;
 
-	assert(pc && to_write);
-	assert(pc->cache_len >= pc->cache_cur);
-	
-	/* If trying to write more than the cache will hold
-	 * flush the cache and allocate enough space immediately,
-	 * that is, don't use the cache. */
-	if(to_write_len > pc->cache_len - pc->cache_cur)
+	for(i = 1; i <= MAX_CODE_BITS; ++i)
 	{
-		unsigned int newlen;
-		flush_cache(pc);
-		newlen = *pc->pbufoutlen + to_write_len;
-		tmp = realloc(*pc->pbufout, newlen);
-		if(!tmp)
-			return 1;
-		memcpy(tmp + *pc->pbufoutlen, to_write, to_write_len);
-		*pc->pbufout = tmp;
-		*pc->pbufoutlen = newlen;
+		code = (code + bl_count[i - 1]) << 1;
+		next_code[i] = code;
 	}
-	else
+
+	for(i = 0; i < MAX_SYMBOLS; ++i)
 	{
-		/* Write the data to the cache. */
-		memcpy(pc->cache + pc->cache_cur, to_write, to_write_len);
-		pc->cache_cur += to_write_len;
-	}
+		uint64_t reversed = 0;
 
-	return 0;
-}
+		if(lengths[i] == 0)
+			continue;
 
-static unsigned int
-get_symbol_frequencies_from_memory(SymbolFrequencies *pSF,
-								   const unsigned char *bufin,
-								   unsigned int bufinlen)
-{
-	unsigned int i;
-	unsigned int total_count = 0;
-	
-	/* Set all frequencies to 0. */
-	init_frequencies(pSF);
-	
-	/* Count the frequency of each symbol in the input file. */
-	for(i = 0; i < bufinlen; ++i)
-	{
-		unsigned char uc = bufin[i];
-		if(!(*pSF)[uc])
-			(*pSF)[uc] = new_leaf_node(uc);
-		++(*pSF)[uc]->count;
-		++total_count;
+		code = next_code[lengths[i]]++;
+		for(j = 0; j < lengths[i]; ++j)
+			reversed |= ((code >> j) & 1) << (lengths[i] - 1 - j);
+		codes[i] = reversed;
 	}
-
-	return total_count;
 }
 
 /*
- * When used by qsort, SFComp sorts the array so that
- * the symbol with the lowest frequency is first. Any
- * NULL entries will be sorted to the end of the list.
+ * The lengths of the symbols being limited, together with what
+ * decides their order: shallower leaves first and, at the same
+ * depth, the more frequent symbol first.
  */
-static int
-SFComp(const void *p1, const void *p2)
+typedef struct code_length_tag
 {
-	const huffman_node *hn1 = *(const huffman_node**)p1;
-	const huffman_node *hn2 = *(const huffman_node**)p2;
-
-	/* Sort all NULLs to the end. */
-	if(hn1 == NULL && hn2 == NULL)
-		return 0;
-	if(hn1 == NULL)
-		return 1;
-	if(hn2 == NULL)
-		return -1;
-	
-	if(hn1->count > hn2->count)
-		return 1;
-	else if(hn1->count < hn2->count)
-		return -1;
+	unsigned int depth;
+	uint64_t count;
+	unsigned char symbol;
+} code_length;
 
-	return 0;
+static int
+CLComp(const void *p1, const void *p2)
+{
+	const code_length *cl1 = (const code_length*)p1;
+	const code_length *cl2 = (const code_length*)p2;
+
+	if(cl1->depth != cl2->depth)
+		return cl1->depth < cl2->depth ? -1 : 1;
+	if(cl1->count != cl2->count)
+		return cl1->count > cl2->count ? -1 : 1;
+	return cl1->symbol < cl2->symbol ? -1 : 1;
 }
 
-
 /*
- * build_symbol_encoder builds a SymbolEncoder by walking
- * down to the leaves of the Huffman tree and then,
- * for each leaf, determines its code.
+ * limit_code_lengths rewrites the n nonzero depths of a complete
+ * Huffman tree so that none exceeds max_bits. It uses the
+ * adjustment from Annex K.3 of the JPEG standard: while some
+ * leaves are too deep, two sibling leaves at the deepest level
+ * are removed, one takes the place of their parent and the
+ * other is paired with the deepest leaf above them, which keeps
+ * the code complete. The resulting lengths go to the symbols in
+ * their original order, so the least frequent symbols absorb
+ * the extra bits. max_bits must allow for n codes.
  */
 static void
-build_symbol_encoder(huffman_node *subtree, SymbolEncoder *pSF)
+limit_code_lengths(unsigned int *depths,
+				   const uint64_t *counts,
+				   unsigned int n,
+				   unsigned int max_bits)
 {
-	if(subtree == NULL)
+	code_length cl[MAX_SYMBOLS];
+	unsigned int bl_count[MAX_SYMBOLS];
+	unsigned int i, j, k, maxdepth = 0;
+
+	memset(bl_count, 0, sizeof(bl_count));
+	for(i = 0, k = 0; i < MAX_SYMBOLS; ++i)
+	{
+		if(depths[i] == 0)
+			continue;
+		cl[k].depth = depths[i];
+		cl[k].count = counts[i];
+		cl[k].symbol = (unsigned char)i;
+		++bl_count[depths[i]];
+		if(depths[i] > maxdepth)
+			maxdepth = depths[i];
+		++k;
+	}
+
+	if(maxdepth <= max_bits)
 		return;
 
-	if(subtree->isLeaf)
-		(*pSF)[subtree->symbol] = new_code(subtree);
-	else
+	for(i = maxdepth; i > max_bits; --i)
+	{
+		while(bl_count[i] > 0)
+		{
+			j = i - 2;
+			while(bl_count[j] == 0)
+				--j;
+			bl_count[i] -= 2;
+			bl_count[i - 1] += 1;
+			bl_count[j + 1] += 2;
+			bl_count[j] -= 1;
+		}
+	}
+
+	qsort(cl, n, sizeof(cl[0]), CLComp);
+	for(i = 1, k = 0; i <= max_bits; ++i)
 	{
-		build_symbol_encoder(subtree->zero, pSF);
-		build_symbol_encoder(subtree->one, pSF);
+		for(j = 0; j < bl_count[i]; ++j)
+			depths[cl[k++].symbol] = i;
 	}
 }
 
 /*
- * calculate_huffman_codes turns pSF into an array
- * with a single entry that is the root of the
- * huffman tree. The return value is a SymbolEncoder,
- * which is an array of huffman codes index by symbol value.
+ * calculate_huffman_codes builds a Huffman tree from the
+ * symbol counts in pSF. The return value is a SymbolEncoder,
+ * which holds the canonical huffman codes indexed
+ * by symbol value. No code is longer than max_bits, or
+ * than the fewest bits that give every symbol a code.
  */
 static SymbolEncoder*
-calculate_huffman_codes(SymbolFrequencies * pSF)
+calculate_huffman_codes(const SymbolFrequencies *pSF, unsigned int max_bits)
 {
 	unsigned int i = 0;
 	unsigned int n = 0;
-	huffman_node *m1 = NULL, *m2 = NULL;
+	unsigned int m1, m2;
 	SymbolEncoder *pSE = NULL;
+	huffman_tree tree;
+	unsigned int leaf = 0, head;
+	unsigned int depths[MAX_SYMBOLS];
+	unsigned char lengths[MAX_SYMBOLS];
+	uint64_t codes[MAX_SYMBOLS];
 
-	/* Sort the symbol frequency array by ascending frequency. */
-	qsort((*pSF), MAX_SYMBOLS, sizeof((*pSF)[0]), SFComp);
+	/* Make a leaf for every symbol that occurs. */
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		if((*pSF)[i])
+		{
+			huffman_node *p = &tree.nodes[n++];
+			p->count = (*pSF)[i];
+			p->zero = p->one = NO_NODE;
+			p->symbol = (unsigned char)i;
+		}
+	}
 
-	/* Get the number of symbols. */
-	for(n = 0; n < MAX_SYMBOLS && (*pSF)[n]; ++n)
-		;
+	/* Sort the leaves by ascending frequency. */
+	qsort(tree.nodes, n, sizeof(tree.nodes[0]), SFComp);
+	tree.nleaves = tree.nnodes = n;
+	head = n;
 
 	/*
 	 * Construct a Huffman tree. This code is based
@@ -399,332 +457,1645 @@ calculate_huffman_codes(SymbolFrequencies * pSF)
 	 * by Ian Witten et al, 2nd edition, page 34.
 	 * Note that this implementation uses a simple
 	 * count instead of probability.
+	 *
+	 * The leaves are sorted once. Each merged set has at
+	 * least the count of the one merged before it, so
+	 * appending them in order keeps them sorted too, and
+	 * the two subsets of least probability are always at
+	 * the front of the leaves or of the sets.
 	 */
-	for(i = 0; i < n - 1; ++i)
+	for(i = 0; i + 1 < n; ++i)
 	{
+		huffman_node *p;
+
 		/* Set m1 and m2 to the two subsets of least probability. */
-		m1 = (*pSF)[0];
-		m2 = (*pSF)[1];
+		m1 = pop_least(&tree, &leaf, &head);
+		m2 = pop_least(&tree, &leaf, &head);
 
-		/* Replace m1 and m2 with a set {m1, m2} whose probability
+		/* Add a set {m1, m2} whose probability
 		 * is the sum of that of m1 and m2. */
-		(*pSF)[0] = m1->parent = m2->parent =
-			new_nonleaf_node(m1->count + m2->count, m1, m2);
-		(*pSF)[1] = NULL;
-		
-		/* Put newSet into the correct count position in pSF. */
-		qsort((*pSF), n, sizeof((*pSF)[0]), SFComp);
+		p = &tree.nodes[tree.nnodes++];
+		p->count = tree.nodes[m1].count + tree.nodes[m2].count;
+		p->zero = (uint16_t)m1;
+		p->one = (uint16_t)m2;
+	}
+
+	/* Get the code lengths from the tree. A lone
+	   symbol still needs a one bit code. */
+	memset(depths, 0, sizeof(depths));
+	get_code_lengths(&tree, depths);
+	if(n == 1)
+		depths[tree.nodes[0].symbol] = 1;
+
+	/* Limit the code lengths, but never below what it takes
+	   to give each of the n symbols a code. */
+	while(max_bits < 8 && n > (1u << max_bits))
+		++max_bits;
+	limit_code_lengths(depths, *pSF, n, max_bits);
+
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		assert(depths[i] <= HUFFMAN_MAX_CODE_BITS);
+		lengths[i] = (unsigned char)depths[i];
 	}
 
-	/* Build the SymbolEncoder array from the tree. */
+	/* Build the SymbolEncoder tables from the canonical codes. */
+	assign_canonical_codes(lengths, codes);
 	pSE = (SymbolEncoder*)malloc(sizeof(SymbolEncoder));
-	memset(pSE, 0, sizeof(SymbolEncoder));
-	build_symbol_encoder((*pSF)[0], pSE);
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		pSE->code[i] = (uint32_t)codes[i];
+		pSE->len[i] = lengths[i];
+	}
+
 	return pSE;
 }
 
 
 /*
- * Allocates memory and sets *pbufout to point to it. The memory
- * contains the code table.
+ * write_code_table_to_memory writes the header: the format
+ * version, the flags, the number of bytes that will be encoded
+ * (in 32 bits for V1 and 64 bits for V2) and the code length
+ * of every symbol from the first to the last one used. The
+ * codes are canonical, so the lengths are all the decoder needs.
+ * When no code is longer than 15 bits the lengths are packed two
+ * to a byte. For more than one stream, room is left at the end for
+ * the stream lengths, which encode_streams fills in. header must
+ * have room for MAX_HEADER_SIZE bytes. The return value is the
+ * length of the header.
  */
-static int
-write_code_table_to_memory(buf_cache *pc,
+static unsigned int
+write_code_table_to_memory(unsigned char *header,
 						   SymbolEncoder *se,
-						   uint32_t symbol_count)
+						   uint64_t symbol_count,
+						   unsigned int nstreams)
 {
-	uint32_t i, count = 0;
+	unsigned int i, first = MAX_SYMBOLS, last = 0, maxbits = 0, len;
+	unsigned int count_len = symbol_count > UINT32_MAX ? 8 : 4;
 
-	/* Determine the number of entries in se. */
 	for(i = 0; i < MAX_SYMBOLS; ++i)
 	{
-		if((*se)[i])
-			++count;
+		if(se->len[i])
+		{
+			if(first == MAX_SYMBOLS)
+				first = i;
+			last = i;
+			if(se->len[i] > maxbits)
+				maxbits = se->len[i];
+		}
 	}
 
-	/* Write the number of entries in network byte order. */
-	i = htonl(count);
-	
-	if(write_cache(pc, &i, sizeof(i)))
-		return 1;
+	header[0] = count_len == 8 ? HUFFMAN_FORMAT_V2 : HUFFMAN_FORMAT_V1;
+	header[1] = maxbits <= 15 ? HUFFMAN_FLAG_NIBBLES : 0;
 
-	/* Write the number of bytes that will be encoded. */
-	symbol_count = htonl(symbol_count);
-	if(write_cache(pc, &symbol_count, sizeof(symbol_count)))
-		return 1;
+	/* Write the number of bytes that will be encoded
+	   in network byte order. */
+	for(i = 0; i < count_len; ++i)
+		header[2 + i] = (unsigned char)(symbol_count >> (8 * (count_len - 1 - i)));
+	len = 2 + count_len;
 
-	/* Write the entries. */
-	for(i = 0; i < MAX_SYMBOLS; ++i)
+	/* The values of first and last are < MAX_SYMBOLS (256),
+	   so they can be stored in an unsigned char. */
+	if(first > last)
+		first = last;
+	header[len++] = (unsigned char)first;
+	header[len++] = (unsigned char)last;
+
+	/* Write the code lengths. */
+	for(i = first; i <= last; ++i)
 	{
-		huffman_code *p = (*se)[i];
-		if(p)
+		unsigned char numbits = se->len[i];
+
+		if(header[1] & HUFFMAN_FLAG_NIBBLES)
 		{
-			unsigned int numbytes;
-			/* The value of i is < MAX_SYMBOLS (256), so it can
-			be stored in an unsigned char. */
-			unsigned char uc = (unsigned char)i;
-			/* Write the 1 byte symbol. */
-			if(write_cache(pc, &uc, sizeof(uc)))
-				return 1;
-			/* Write the 1 byte code bit length. */
-			uc = (unsigned char)p->numbits;
-			if(write_cache(pc, &uc, sizeof(uc)))
-				return 1;
-			/* Write the code bytes. */
-			numbytes = numbytes_from_numbits(p->numbits);
-			if(write_cache(pc, p->bits, numbytes))
-				return 1;
+			if((i - first) % 2 == 0)
+				header[len++] = numbits;
+			else
+				header[len - 1] |= numbits << 4;
 		}
+		else
+			header[len++] = numbits;
 	}
 
-	return 0;
+	if(nstreams > 1)
+	{
+		header[1] |= HUFFMAN_FLAG_STREAMS;
+		header[len++] = (unsigned char)nstreams;
+		memset(header + len, 0, 8 * (nstreams - 1));
+		len += 8 * (nstreams - 1);
+	}
+
+	return len;
 }
 
-static int
-memread(const unsigned char* buf,
-		unsigned int buflen,
-		unsigned int *pindex,
-		void* bufout,
-		unsigned int readlen)
+/*
+ * The decoder resolves codes with lookup tables instead of walking
+ * the Huffman tree one bit at a time. The root table is indexed by
+ * the next root_bits bits of input (the first code bit is the lowest
+ * bit of the index) and resolves every code that is no longer than
+ * that in a single lookup. Longer codes go through a link entry to a
+ * subtable indexed by the bits that follow.
+ *
+ * Each table entry is packed into 32 bits. A leaf entry holds the
+ * symbol in bits 0-7 and the number of code bits it consumes at its
+ * level in bits 8-15. A link entry has bit 31 set, the width of the
+ * subtable in bits 24-28 and the offset of the subtable in bits 0-23.
+ * An entry of 0 marks a bit pattern that is not a valid code.
+ */
+#define DECODE_ROOT_BITS 11
+#define DECODE_LINK 0x80000000u
+
+#define LEAF_ENTRY(symbol, numbits) \
+	((uint32_t)(symbol) | ((uint32_t)(numbits) << 8))
+#define LINK_ENTRY(offset, width) \
+	(DECODE_LINK | ((uint32_t)(width) << 24) | (uint32_t)(offset))
+#define ENTRY_SYMBOL(e) ((unsigned char)((e) & 0xff))
+#define ENTRY_NUMBITS(e) (((e) >> 8) & 0xff)
+#define ENTRY_WIDTH(e) (((e) >> 24) & 0x1f)
+#define ENTRY_OFFSET(e) ((e) & 0xffffff)
+
+typedef struct decode_code_tag
 {
-	assert(buf && pindex && bufout);
-	assert(buflen >= *pindex);
-	if(buflen < *pindex)
-		return 1;
-	if(readlen + *pindex >= buflen)
-		return 1;
-	memcpy(bufout, buf + *pindex, readlen);
-	*pindex += readlen;
-	return 0;
+	/* The code with its first bit at position 0. */
+	uint64_t code;
+	unsigned char numbits;
+	unsigned char symbol;
+} decode_code;
+
+typedef struct huffman_decoder_tag
+{
+	uint32_t *table;
+	unsigned int table_len;
+	unsigned int table_cap;
+	unsigned int root_bits;
+	unsigned int max_bits;
+
+	/* The number of symbols that can be decoded from one
+	   refill of the bit buffer. */
+	unsigned int per_refill;
+} huffman_decoder;
+
+/*
+ * bit_reader keeps up to 64 bits of input in bitbuf, the next
+ * unread bit in position 0. Once the input is exhausted it is
+ * padded with zero bits, which are counted in pad_bits so that
+ * reading past the end can be detected.
+ */
+typedef struct bit_reader_tag
+{
+	const unsigned char *cur;
+	const unsigned char *end;
+	uint64_t bitbuf;
+	unsigned int bitcount;
+	uint64_t pad_bits;
+} bit_reader;
+
+static uint64_t
+load_le64(const unsigned char *p)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+#else
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+		(uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+		(uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+		(uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+#endif
 }
 
-static huffman_node*
-read_code_table_from_memory(const unsigned char* bufin,
-							unsigned int bufinlen,
-							unsigned int *pindex,
-							uint32_t *pDataBytes)
+static void
+store_le64(unsigned char *p, uint64_t v)
 {
-	huffman_node *root = new_nonleaf_node(0, NULL, NULL);
-	uint32_t count;
-	
-	/* Read the number of entries.
-	   (it is stored in network byte order). */
-	if(memread(bufin, bufinlen, pindex, &count, sizeof(count)))
-	{
-		free_huffman_tree(root);
-		return NULL;
-	}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(p, &v, sizeof(v));
+#else
+	unsigned int i;
+	for(i = 0; i < 8; ++i)
+		p[i] = (unsigned char)(v >> (i * 8));
+#endif
+}
 
-	count = ntohl(count);
+static void
+init_bit_reader(bit_reader *br,
+				const unsigned char *bufin,
+				uint64_t bufinlen)
+{
+	br->cur = bufin;
+	br->end = bufin + bufinlen;
+	br->bitbuf = 0;
+	br->bitcount = 0;
+	br->pad_bits = 0;
+}
 
-	/* Read the number of data bytes this encoding represents. */
-	if(memread(bufin, bufinlen, pindex, pDataBytes, sizeof(*pDataBytes)))
+/*
+ * refill tops bitbuf up to at least MAX_CODE_BITS bits. While 8
+ * bytes of input remain this is a single unaligned load; the bits
+ * above bitcount that it also brings in belong to the byte at cur
+ * and are simply loaded again by the next refill.
+ */
+static inline void
+refill(bit_reader *br)
+{
+	if(br->end - br->cur >= 8)
 	{
-		free_huffman_tree(root);
-		return NULL;
+		br->bitbuf |= load_le64(br->cur) << br->bitcount;
+		br->cur += (63 - br->bitcount) >> 3;
+		br->bitcount |= 56;
+		return;
 	}
 
-	*pDataBytes = ntohl(*pDataBytes);
-
-	/* Read the entries. */
-	while(count-- > 0)
+	while(br->bitcount <= 56)
 	{
-		unsigned int curbit;
-		unsigned char symbol;
-		unsigned char numbits;
-		unsigned char numbytes;
-		unsigned char *bytes;
-		huffman_node *p = root;
+		if(br->cur < br->end)
+			br->bitbuf |= (uint64_t)*br->cur++ << br->bitcount;
+		else
+			br->pad_bits += 8;
+		br->bitcount += 8;
+	}
+}
 
-		if(memread(bufin, bufinlen, pindex, &symbol, sizeof(symbol)))
-		{
-			free_huffman_tree(root);
-			return NULL;
-		}
+static inline void
+consume_bits(bit_reader *br, unsigned int numbits)
+{
+	br->bitbuf >>= numbits;
+	br->bitcount -= numbits;
+}
 
-		if(memread(bufin, bufinlen, pindex, &numbits, sizeof(numbits)))
-		{
-			free_huffman_tree(root);
-			return NULL;
-		}
-		
-		numbytes = (unsigned char)numbytes_from_numbits(numbits);
-		bytes = (unsigned char*)malloc(numbytes);
-		if(memread(bufin, bufinlen, pindex, bytes, numbytes))
-		{
-			free(bytes);
-			free_huffman_tree(root);
-			return NULL;
-		}
+/*
+ * decode_symbol decodes one symbol. The bit buffer must hold
+ * at least max_bits bits. Returns 1 on an invalid code.
+ */
+static inline int
+decode_symbol(const huffman_decoder *d, bit_reader *br, unsigned char *psym)
+{
+	unsigned int width = d->root_bits;
+	uint32_t e = d->table[br->bitbuf & ((1u << width) - 1)];
 
-		/*
-		 * Add the entry to the Huffman tree. The value
-		 * of the current bit is used switch between
-		 * zero and one child nodes in the tree. New nodes
-		 * are added as needed in the tree.
-		 */
-		for(curbit = 0; curbit < numbits; ++curbit)
-		{
-			if(get_bit(bytes, curbit))
-			{
-				if(p->one == NULL)
-				{
-					p->one = curbit == (unsigned char)(numbits - 1)
-						? new_leaf_node(symbol)
-						: new_nonleaf_node(0, NULL, NULL);
-					p->one->parent = p;
-				}
-				p = p->one;
-			}
-			else
-			{
-				if(p->zero == NULL)
-				{
-					p->zero = curbit == (unsigned char)(numbits - 1)
-						? new_leaf_node(symbol)
-						: new_nonleaf_node(0, NULL, NULL);
-					p->zero->parent = p;
-				}
-				p = p->zero;
-			}
-		}
-		
-		free(bytes);
+	while(e & DECODE_LINK)
+	{
+		consume_bits(br, width);
+		width = ENTRY_WIDTH(e);
+		e = d->table[ENTRY_OFFSET(e) + (br->bitbuf & ((1u << width) - 1))];
 	}
 
-	return root;
+	if(e == 0)
+		return 1;
+
+	consume_bits(br, ENTRY_NUMBITS(e));
+	*psym = ENTRY_SYMBOL(e);
+	return 0;
 }
 
 static int
-do_memory_encode(buf_cache *pc,
-				 const unsigned char* bufin,
-				 unsigned int bufinlen,
-				 SymbolEncoder *se)
+reserve_table(huffman_decoder *d, unsigned int width, unsigned int *poffset)
 {
-	unsigned char curbyte = 0;
-	unsigned char curbit = 0;
-	unsigned int i;
-	
-	for(i = 0; i < bufinlen; ++i)
-	{
-		unsigned char uc = bufin[i];
-		huffman_code *code = (*se)[uc];
-		unsigned long i;
-		
-		for(i = 0; i < code->numbits; ++i)
-		{
-			/* Add the current bit to curbyte. */
-			curbyte |= get_bit(code->bits, i) << curbit;
+	unsigned int size = 1u << width;
 
-			/* If this byte is filled up then write it
-			 * out and reset the curbit and curbyte. */
-			if(++curbit == 8)
-			{
-				if(write_cache(pc, &curbyte, sizeof(curbyte)))
-					return 1;
-				curbyte = 0;
-				curbit = 0;
-			}
-		}
+	if(d->table_len + size > d->table_cap)
+	{
+		unsigned int newcap = d->table_cap ? d->table_cap : 1;
+		uint32_t *tmp;
+		while(newcap < d->table_len + size)
+			newcap *= 2;
+		tmp = (uint32_t*)realloc(d->table, newcap * sizeof(uint32_t));
+		if(!tmp)
+			return 1;
+		d->table = tmp;
+		d->table_cap = newcap;
+	}
+
+	memset(d->table + d->table_len, 0, size * sizeof(uint32_t));
+	*poffset = d->table_len;
+	d->table_len += size;
+	return 0;
+}
+
+/*
+ * fill_table fills the table of the given width at offset with
+ * codes, all of which share the same first consumed bits. Codes
+ * that do not fit in the table are grouped by the bits that index
+ * it and placed in subtables, recursively.
+ */
+static int
+fill_table(huffman_decoder *d,
+		   unsigned int offset,
+		   unsigned int width,
+		   unsigned int consumed,
+		   const decode_code *codes,
+		   unsigned int n)
+{
+	unsigned char maxbits[1 << DECODE_ROOT_BITS];
+	decode_code group[MAX_SYMBOLS];
+	uint32_t mask = (1u << width) - 1;
+	unsigned int i, j;
+
+	memset(maxbits, 0, sizeof(maxbits));
+
+	for(i = 0; i < n; ++i)
+	{
+		unsigned int numbits = codes[i].numbits - consumed;
+		uint32_t index = (uint32_t)(codes[i].code >> consumed) & mask;
+
+		if(numbits <= width)
+		{
+			/* Replicate the entry for every value
+			   of the bits that follow the code. */
+			for(j = index; j <= mask; j += 1u << numbits)
+			{
+				if(d->table[offset + j])
+					return 1;
+				d->table[offset + j] = LEAF_ENTRY(codes[i].symbol, numbits);
+			}
+		}
+		else if(numbits - width > maxbits[index])
+			maxbits[index] = (unsigned char)(numbits - width);
+	}
+
+	for(j = 0; j <= mask; ++j)
+	{
+		unsigned int subwidth, suboffset, count = 0;
+
+		if(maxbits[j] == 0)
+			continue;
+
+		if(d->table[offset + j])
+			return 1;
+
+		for(i = 0; i < n; ++i)
+		{
+			if(codes[i].numbits - consumed > width &&
+			   ((uint32_t)(codes[i].code >> consumed) & mask) == j)
+				group[count++] = codes[i];
+		}
+
+		subwidth = maxbits[j] < DECODE_ROOT_BITS
+			? maxbits[j] : DECODE_ROOT_BITS;
+		if(reserve_table(d, subwidth, &suboffset))
+			return 1;
+		d->table[offset + j] = LINK_ENTRY(suboffset, subwidth);
+
+		if(fill_table(d, suboffset, subwidth, consumed + width, group, count))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+free_decoder(huffman_decoder *d)
+{
+	free(d->table);
+	d->table = NULL;
+}
+
+/*
+ * init_decoder builds the decode tables for the n codes. Returns
+ * 1 if the codes are too long to decode or are not prefix free.
+ */
+static int
+init_decoder(huffman_decoder *d, const decode_code *codes, unsigned int n)
+{
+	unsigned int i, offset;
+
+	memset(d, 0, sizeof(*d));
+
+	for(i = 0; i < n; ++i)
+	{
+		if(codes[i].numbits == 0 || codes[i].numbits > MAX_CODE_BITS)
+			return 1;
+		if(codes[i].numbits > d->max_bits)
+			d->max_bits = codes[i].numbits;
+	}
+
+	d->root_bits = d->max_bits < DECODE_ROOT_BITS
+		? d->max_bits : DECODE_ROOT_BITS;
+	d->per_refill = d->max_bits ? MAX_CODE_BITS / d->max_bits : 1;
+
+	if(n == 0)
+		return 0;
+
+	if(reserve_table(d, d->root_bits, &offset) ||
+	   fill_table(d, offset, d->root_bits, 0, codes, n))
+	{
+		free_decoder(d);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * decode_memory decodes count symbols from the bit reader into
+ * bufout. Returns 1 if the input holds an invalid code or ends
+ * before count symbols have been decoded.
+ */
+static int
+decode_memory(const huffman_decoder *d,
+			  bit_reader *br,
+			  unsigned char *bufout,
+			  uint64_t count)
+{
+	unsigned char *end = bufout + count;
+
+	while(bufout < end)
+	{
+		unsigned int k = d->per_refill;
+		if((uint64_t)k > (uint64_t)(end - bufout))
+			k = (unsigned int)(end - bufout);
+
+		refill(br);
+		while(k-- > 0)
+		{
+			if(decode_symbol(d, br, bufout++))
+				return 1;
+		}
+
+		/* The padding must not have been consumed. */
+		if(br->pad_bits > br->bitcount)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * store_be64 and load_be64 write and read 64-bit values
+ * in network byte order.
+ */
+static void
+store_be64(unsigned char *p, uint64_t value)
+{
+	int i;
+
+	for(i = 7; i >= 0; --i, value >>= 8)
+		p[i] = (unsigned char)value;
+}
+
+static uint64_t
+load_be64(const unsigned char *p)
+{
+	uint64_t value = 0;
+	int i;
+
+	for(i = 0; i < 8; ++i)
+		value = value << 8 | p[i];
+	return value;
+}
+
+/*
+ * image_streams describes where the bitstreams of an image are:
+ * their number and the length in bytes of each, starting from the
+ * end of the header.
+ */
+typedef struct image_streams_tag
+{
+	unsigned int n;
+	uint64_t len[HUFFMAN_MAX_STREAMS];
+} image_streams;
+
+/*
+ * decode_four decodes rounds symbols from each of the four streams
+ * at br, one from every stream in turn, and writes the symbols of a
+ * round to bufout, stride bytes after those of the previous one.
+ * The streams are kept in local copies so that nothing they hold
+ * can be changed by the stores to bufout, and the lookups in them
+ * do not depend on each other, so the processor can work on all
+ * four at once.
+ */
+static int
+decode_four(const huffman_decoder *d,
+			bit_reader *br,
+			unsigned char *bufout,
+			unsigned int stride,
+			uint64_t rounds)
+{
+	bit_reader b0 = br[0], b1 = br[1], b2 = br[2], b3 = br[3];
+	unsigned char s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	unsigned int k;
+	int rc = 0;
+
+	while(rounds > 0 && rc == 0)
+	{
+		k = d->per_refill;
+		if((uint64_t)k > rounds)
+			k = (unsigned int)rounds;
+		rounds -= k;
+
+		refill(&b0);
+		refill(&b1);
+		refill(&b2);
+		refill(&b3);
+		while(k-- > 0)
+		{
+			rc = decode_symbol(d, &b0, &s0) | decode_symbol(d, &b1, &s1) |
+				decode_symbol(d, &b2, &s2) | decode_symbol(d, &b3, &s3);
+			if(rc)
+				break;
+			bufout[0] = s0;
+			bufout[1] = s1;
+			bufout[2] = s2;
+			bufout[3] = s3;
+			bufout += stride;
+		}
+
+		/* The padding must not have been consumed. */
+		if(rc || b0.pad_bits > b0.bitcount || b1.pad_bits > b1.bitcount ||
+		   b2.pad_bits > b2.bitcount || b3.pad_bits > b3.bitcount)
+			rc = 1;
+	}
+
+	br[0] = b0;
+	br[1] = b1;
+	br[2] = b2;
+	br[3] = b3;
+	return rc;
+}
+
+/*
+ * decode_strided decodes count symbols from br like decode_memory,
+ * but writes them stride bytes apart.
+ */
+static int
+decode_strided(const huffman_decoder *d,
+			   bit_reader *br,
+			   unsigned char *bufout,
+			   unsigned int stride,
+			   uint64_t count)
+{
+	for(; count > 0; --count, bufout += stride)
+	{
+		if(decode_memory(d, br, bufout, 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * decode_streams decodes count symbols from the streams of an
+ * image, the first of which starts at data, into bufout. The
+ * streams are decoded four at a time, and any that are left
+ * one at a time.
+ */
+static int
+decode_streams(const huffman_decoder *d,
+			   const unsigned char *data,
+			   const image_streams *streams,
+			   unsigned char *bufout,
+			   uint64_t count)
+{
+	bit_reader br[HUFFMAN_MAX_STREAMS];
+	uint64_t rounds = count / streams->n;
+	unsigned int n = streams->n, s;
+
+	for(s = 0; s < n; data += streams->len[s++])
+		init_bit_reader(&br[s], data, streams->len[s]);
+
+	for(s = 0; s + 4 <= n; s += 4)
+	{
+		if(decode_four(d, &br[s], bufout + s, n, rounds))
+			return 1;
+	}
+	for(; s < n; ++s)
+	{
+		if(decode_strided(d, &br[s], bufout + s, n, rounds))
+			return 1;
+	}
+
+	/* The first count % n streams hold one more symbol. */
+	bufout += rounds * n;
+	for(s = 0; s < count % n; ++s)
+	{
+		if(decode_memory(d, &br[s], bufout + s, 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+memread(const unsigned char* buf,
+		uint64_t buflen,
+		uint64_t *pindex,
+		void* bufout,
+		unsigned int readlen)
+{
+	assert(buf && pindex && bufout);
+	assert(buflen >= *pindex);
+	if(buflen < *pindex)
+		return 1;
+	if(readlen > buflen - *pindex)
+		return 1;
+	memcpy(bufout, buf + *pindex, readlen);
+	*pindex += readlen;
+	return 0;
+}
+
+/*
+ * read_legacy_code_table reads the code table of the legacy
+ * format, which holds every code bit by bit, into codes.
+ */
+static int
+read_legacy_code_table(const unsigned char* bufin,
+					   uint64_t bufinlen,
+					   uint64_t *pindex,
+					   uint64_t *pDataBytes,
+					   decode_code *codes,
+					   unsigned int *pn)
+{
+	uint32_t count, data_count;
+
+	/* Read the number of entries.
+	   (it is stored in network byte order). */
+	if(memread(bufin, bufinlen, pindex, &count, sizeof(count)))
+		return 1;
+
+	count = ntohl(count);
+	if(count > MAX_SYMBOLS)
+		return 1;
+
+	/* Read the number of data bytes this encoding represents. */
+	if(memread(bufin, bufinlen, pindex, &data_count, sizeof(data_count)))
+		return 1;
+
+	*pDataBytes = ntohl(data_count);
+
+	/* Read the entries. */
+	for(*pn = 0; *pn < count; ++*pn)
+	{
+		unsigned char bytes[32];
+		unsigned char numbits;
+		unsigned int i;
+		decode_code *p = &codes[*pn];
+
+		if(memread(bufin, bufinlen, pindex, &p->symbol, sizeof(p->symbol)))
+			return 1;
+
+		if(memread(bufin, bufinlen, pindex, &numbits, sizeof(numbits)))
+			return 1;
+
+		if(memread(bufin, bufinlen, pindex, bytes,
+				   numbytes_from_numbits(numbits)))
+			return 1;
+
+		if(numbits == 0 || numbits > MAX_CODE_BITS)
+			return 1;
+
+		p->numbits = numbits;
+		p->code = 0;
+		for(i = 0; i < numbits; ++i)
+			p->code |= (uint64_t)get_bit(bytes, i) << i;
+	}
+
+	return 0;
+}
+
+/*
+ * read_stream_lengths reads the number of streams and their lengths
+ * that follow the code lengths of a header with HUFFMAN_FLAG_STREAMS.
+ * The last stream takes the rest of the image.
+ */
+static int
+read_stream_lengths(const unsigned char* bufin,
+					uint64_t bufinlen,
+					uint64_t *pindex,
+					image_streams *streams)
+{
+	unsigned char n, len[8];
+	uint64_t total = 0;
+	unsigned int s;
+
+	if(memread(bufin, bufinlen, pindex, &n, sizeof(n)) ||
+	   n < 2 || n > HUFFMAN_MAX_STREAMS)
+		return 1;
+
+	streams->n = n;
+	for(s = 0; s + 1 < streams->n; ++s)
+	{
+		if(memread(bufin, bufinlen, pindex, len, sizeof(len)))
+			return 1;
+		streams->len[s] = load_be64(len);
+		if(streams->len[s] > UINT64_MAX - total)
+			return 1;
+		total += streams->len[s];
+	}
+
+	if(total > bufinlen - *pindex)
+		return 1;
+
+	streams->len[s] = bufinlen - *pindex - total;
+	return 0;
+}
+
+/*
+ * read_code_table_from_memory reads the header written by
+ * write_code_table_to_memory, or a legacy code table, and
+ * returns the codes it describes and where its streams are.
+ */
+static int
+read_code_table_from_memory(const unsigned char* bufin,
+							uint64_t bufinlen,
+							uint64_t *pindex,
+							uint64_t *pDataBytes,
+							decode_code *codes,
+							unsigned int *pn,
+							image_streams *streams)
+{
+	unsigned char version, flags, first, last;
+	unsigned char count[8];
+	unsigned int count_len;
+	unsigned char lengths[MAX_SYMBOLS];
+	uint64_t canonical[MAX_SYMBOLS];
+	unsigned int i;
+
+	if(*pindex < bufinlen && bufin[*pindex] == HUFFMAN_FORMAT_LEGACY)
+	{
+		if(read_legacy_code_table(bufin, bufinlen, pindex,
+								  pDataBytes, codes, pn))
+			return 1;
+		streams->n = 1;
+		streams->len[0] = bufinlen - *pindex;
+		return 0;
+	}
+
+	if(memread(bufin, bufinlen, pindex, &version, sizeof(version)) ||
+	   (version != HUFFMAN_FORMAT_V1 && version != HUFFMAN_FORMAT_V2))
+		return 1;
+
+	/* Flags this decoder does not know change the
+	   meaning of the data, so they are an error. */
+	if(memread(bufin, bufinlen, pindex, &flags, sizeof(flags)) ||
+	   (flags & ~(HUFFMAN_FLAG_NIBBLES | HUFFMAN_FLAG_STREAMS)))
+		return 1;
+
+	/* Read the number of data bytes this encoding represents
+	   (it is stored in network byte order). */
+	count_len = version == HUFFMAN_FORMAT_V2 ? 8 : 4;
+	if(memread(bufin, bufinlen, pindex, count, count_len))
+		return 1;
+
+	for(*pDataBytes = 0, i = 0; i < count_len; ++i)
+		*pDataBytes = *pDataBytes << 8 | count[i];
+
+	/* Read the code lengths. */
+	if(memread(bufin, bufinlen, pindex, &first, sizeof(first)) ||
+	   memread(bufin, bufinlen, pindex, &last, sizeof(last)) ||
+	   first > last)
+		return 1;
+
+	memset(lengths, 0, sizeof(lengths));
+	if(flags & HUFFMAN_FLAG_NIBBLES)
+	{
+		unsigned char packed[MAX_SYMBOLS / 2];
+		if(memread(bufin, bufinlen, pindex, packed, (last - first) / 2 + 1))
+			return 1;
+		for(i = first; i <= last; ++i)
+			lengths[i] = (packed[(i - first) / 2] >> ((i - first) % 2 * 4)) & 0x0f;
+	}
+	else if(memread(bufin, bufinlen, pindex, lengths + first, last - first + 1))
+		return 1;
+
+	for(i = first; i <= last; ++i)
+	{
+		if(lengths[i] > MAX_CODE_BITS)
+			return 1;
+	}
+
+	if(flags & HUFFMAN_FLAG_STREAMS)
+	{
+		if(read_stream_lengths(bufin, bufinlen, pindex, streams))
+			return 1;
+	}
+	else
+	{
+		streams->n = 1;
+		streams->len[0] = bufinlen - *pindex;
+	}
+
+	/* Rebuild the canonical codes from the lengths. */
+	assign_canonical_codes(lengths, canonical);
+	for(*pn = 0, i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		if(lengths[i])
+		{
+			codes[*pn].code = canonical[i];
+			codes[*pn].numbits = lengths[i];
+			codes[*pn].symbol = (unsigned char)i;
+			++*pn;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * get_max_code_bits returns the length of the
+ * longest code in se.
+ */
+static unsigned int
+get_max_code_bits(SymbolEncoder *se)
+{
+	unsigned int i, maxbits = 0;
+
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+	{
+		if(se->len[i] > maxbits)
+			maxbits = se->len[i];
+	}
+
+	return maxbits;
+}
+
+/*
+ * get_encoded_bits returns the number of bits the symbols
+ * counted in pSF take once encoded.
+ */
+static uint64_t
+get_encoded_bits(const SymbolFrequencies *pSF, SymbolEncoder *se)
+{
+	uint64_t numbits = 0;
+	unsigned int i;
+
+	for(i = 0; i < MAX_SYMBOLS; ++i)
+		numbits += (uint64_t)(*pSF)[i] * se->len[i];
+
+	return numbits;
+}
+
+/*
+ * do_memory_encode encodes count symbols, stride bytes apart from
+ * bufin on, into bufout and returns the number of bits written.
+ * The codes are ORed into a 64-bit accumulator and every flush
+ * stores all 8 bytes of it, but only advances past the bytes that
+ * are complete. bufout must therefore have 8 bytes of room past
+ * the encoded data. The bits of the last byte that are not used
+ * are 0.
+ */
+static uint64_t
+do_memory_encode(unsigned char *bufout,
+				 const unsigned char* bufin,
+				 uint64_t count,
+				 unsigned int stride,
+				 SymbolEncoder *se)
+{
+	unsigned char *out = bufout;
+	uint64_t acc = 0;
+	unsigned int nbits = 0;
+	unsigned int maxbits = get_max_code_bits(se);
+
+	/* The number of codes that fit in the accumulator on top
+	   of the up to 7 bits left over from the last flush. */
+	unsigned int per_flush = maxbits ? 56 / maxbits : 1;
+
+	while(count > 0)
+	{
+		unsigned int k = per_flush;
+		if((uint64_t)k > count)
+			k = (unsigned int)count;
+		count -= k;
+
+		while(k-- > 0)
+		{
+			unsigned char symbol = *bufin;
+			bufin += stride;
+			acc |= (uint64_t)se->code[symbol] << nbits;
+			nbits += se->len[symbol];
+		}
+
+		store_le64(out, acc);
+		out += nbits >> 3;
+		acc >>= nbits & ~7u;
+		nbits &= 7;
+	}
+
+	return (uint64_t)(out - bufout) * 8 + nbits;
+}
+
+/*
+ * encode_streams codes symbol i of bufin into stream i % nstreams.
+ * The streams are written to bufout one after the other, each
+ * starting on a byte boundary, and the length in bytes of all but
+ * the last is stored at lengths. bufout must have room for the
+ * encoded data, a byte per stream and the 8 bytes do_memory_encode
+ * may store past the end. Returns the number of bytes written.
+ */
+static uint64_t
+encode_streams(unsigned char *bufout,
+			   unsigned char *lengths,
+			   const unsigned char *bufin,
+			   uint64_t bufinlen,
+			   unsigned int nstreams,
+			   SymbolEncoder *se)
+{
+	uint64_t len = 0, n;
+	unsigned int s;
+
+	for(s = 0; s < nstreams; ++s)
+	{
+		/* The first bufinlen % nstreams streams
+		   hold one symbol more than the others. */
+		n = bufinlen / nstreams + (s < bufinlen % nstreams);
+		n = (do_memory_encode(bufout + len, bufin + s, n, nstreams, se) + 7) / 8;
+		if(s + 1 < nstreams)
+			store_be64(lengths + 8 * s, n);
+		len += n;
+	}
+
+	return len;
+}
+
+/*
+ * encode_image codes bufin as a single image with its own code
+ * table, using only the calling thread. Images coded this way
+ * share nothing, so several of them can be coded at once.
+ */
+static int
+encode_image(const unsigned char *bufin,
+			 uint64_t bufinlen,
+			 unsigned char **pbufout,
+			 uint64_t *pbufoutlen,
+			 const huffman_params *params)
+{
+	SymbolFrequencies sf;
+	SymbolEncoder *se;
+	int rc = 0;
+	uint64_t symbol_count, numbytes;
+	unsigned char header[MAX_HEADER_SIZE];
+	unsigned int header_len;
+	unsigned char *buf;
+
+	*pbufout = NULL;
+	*pbufoutlen = 0;
+
+	/* Get the frequency of each symbol in the input memory. */
+	symbol_count = get_symbol_frequencies_from_memory(&sf, bufin, bufinlen);
+
+	/* Build an optimal table from the symbolCount. */
+	se = calculate_huffman_codes(&sf, params->max_bits);
+
+	/* The counts and the code lengths give the size of the encoded
+	   data, to within the partly used last byte of every stream,
+	   so the output is allocated once. The encoder may store up
+	   to 8 bytes past the end of the data. */
+	header_len = write_code_table_to_memory(header, se, symbol_count,
+											params->streams);
+	numbytes = (get_encoded_bits(&sf, se) + 7) / 8 + params->streams - 1;
+	buf = header_len + numbytes + 8 > SIZE_MAX ? NULL :
+		(unsigned char*)malloc((size_t)(header_len + numbytes + 8));
+	if(!buf)
+		rc = 1;
+	else
+	{
+		memcpy(buf, header, header_len);
+
+		/* Scan the memory again and, using the table
+		   previously built, encode it into the output memory. */
+		numbytes = encode_streams(buf + header_len,
+								  buf + header_len - 8 * (params->streams - 1),
+								  bufin, bufinlen, params->streams, se);
+		*pbufout = buf;
+		*pbufoutlen = header_len + numbytes;
 	}
 
-	/*
-	 * If there is data in curbyte that has not been
-	 * output yet, which means that the last encoded
-	 * character did not fall on a byte boundary,
-	 * then output it.
-	 */
-	return curbit > 0 ? write_cache(pc, &curbyte, sizeof(curbyte)) : 0;
+	free_encoder(se);
+	return rc;
+}
+
+/*
+ * encode_blocks splits bufin into nblocks blocks of block_size
+ * bytes, the last of which may be shorter, and codes block i into
+ * images[i] and imagelens[i].
+ */
+static int
+encode_blocks(const unsigned char *bufin,
+			  uint64_t bufinlen,
+			  unsigned int block_size,
+			  uint64_t nblocks,
+			  unsigned char **images,
+			  uint64_t *imagelens,
+			  const huffman_params *params)
+{
+	uint64_t i, len;
+
+	for(i = 0; i < nblocks; ++i)
+	{
+		len = bufinlen - i * block_size;
+		if(len > block_size)
+			len = block_size;
+		if(encode_image(bufin + i * block_size, len,
+						&images[i], &imagelens[i], params))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * write_index_trailer writes the end of the block index for a
+ * stream of nblocks blocks that decode to total bytes, and
+ * returns its length.
+ */
+static unsigned int
+write_index_trailer(unsigned char *p, uint64_t total, uint64_t nblocks)
+{
+	store_be64(p, total);
+	store_be64(p + 8, nblocks);
+	memcpy(p + 16, INDEX_MAGIC, 4);
+	return INDEX_TRAILER_SIZE;
 }
 
-#define CACHE_SIZE 1024
+void huffman_params_init(huffman_params *params)
+{
+	params->max_bits = HUFFMAN_MAX_CODE_BITS;
+	params->block_size = HUFFMAN_DEFAULT_BLOCK_SIZE;
+	params->block_index = 0;
+	params->streams = 1;
+}
 
 int huffman_encode_memory(const unsigned char *bufin,
 						  unsigned int bufinlen,
 						  unsigned char **pbufout,
 						  unsigned int *pbufoutlen)
 {
-	SymbolFrequencies sf;
-	SymbolEncoder *se;
-	huffman_node *root = NULL;
-	int rc;
-	unsigned int symbol_count;
-	buf_cache cache;
+	return huffman_encode_memory_ex(bufin, bufinlen,
+									pbufout, pbufoutlen, NULL);
+}
+
+int huffman_encode_memory_ex(const unsigned char *bufin,
+							 unsigned int bufinlen,
+							 unsigned char **pbufout,
+							 unsigned int *pbufoutlen,
+							 const huffman_params *params)
+{
+	uint64_t len;
+
+	if(!pbufoutlen ||
+	   huffman_encode_memory64_ex(bufin, bufinlen, pbufout, &len, params))
+		return 1;
+
+	/* The encoding of 4 GiB or less can still be longer. */
+	if(len > UINT32_MAX)
+	{
+		free(*pbufout);
+		*pbufout = NULL;
+		return 1;
+	}
+
+	*pbufoutlen = (unsigned int)len;
+	return 0;
+}
+
+int huffman_encode_memory64(const unsigned char *bufin,
+							uint64_t bufinlen,
+							unsigned char **pbufout,
+							uint64_t *pbufoutlen)
+{
+	return huffman_encode_memory64_ex(bufin, bufinlen,
+									  pbufout, pbufoutlen, NULL);
+}
+
+int huffman_encode_memory64_ex(const unsigned char *bufin,
+							   uint64_t bufinlen,
+							   unsigned char **pbufout,
+							   uint64_t *pbufoutlen,
+							   const huffman_params *params)
+{
+	huffman_params defaults;
+
+	if(!params)
+	{
+		huffman_params_init(&defaults);
+		params = &defaults;
+	}
 
 	/* Ensure the arguments are valid. */
-	if(!pbufout || !pbufoutlen)
+	if(!pbufout || !pbufoutlen || params->max_bits < 1 ||
+	   params->max_bits > HUFFMAN_MAX_CODE_BITS ||
+	   params->streams < 1 || params->streams > HUFFMAN_MAX_STREAMS)
 		return 1;
 
-	if(init_cache(&cache, CACHE_SIZE, pbufout, pbufoutlen))
+	return encode_image(bufin, bufinlen, pbufout, pbufoutlen, params);
+}
+
+/*
+ * huffman_encode_memory_blocks writes a HUFFMAN_FORMAT_BLOCKS
+ * stream: the input is cut into blocks of params->block_size bytes
+ * and every block is coded with its own table. The blocks do not
+ * depend on each other, so no histogram of the whole input is
+ * needed.
+ */
+int huffman_encode_memory_blocks(const unsigned char *bufin,
+								 uint64_t bufinlen,
+								 unsigned char **pbufout,
+								 uint64_t *pbufoutlen,
+								 const huffman_params *params)
+{
+	huffman_params defaults;
+	unsigned char **images;
+	uint64_t *imagelens;
+	uint64_t nblocks, i, len;
+	unsigned char *buf;
+	uint32_t blocklen;
+	int rc;
+
+	if(!params)
+	{
+		huffman_params_init(&defaults);
+		params = &defaults;
+	}
+
+	/* Ensure the arguments are valid. */
+	if(!pbufout || !pbufoutlen || params->max_bits < 1 ||
+	   params->max_bits > HUFFMAN_MAX_CODE_BITS ||
+	   params->streams < 1 || params->streams > HUFFMAN_MAX_STREAMS ||
+	   params->block_size < 1 ||
+	   params->block_size > HUFFMAN_MAX_BLOCK_SIZE)
 		return 1;
 
-	/* Get the frequency of each symbol in the input memory. */
-	symbol_count = get_symbol_frequencies_from_memory(&sf, bufin, bufinlen);
+	*pbufout = NULL;
+	*pbufoutlen = 0;
 
-	/* Build an optimal table from the symbolCount. */
-	se = calculate_huffman_codes(&sf);
-	root = sf[0];
+	nblocks = bufinlen / params->block_size +
+		(bufinlen % params->block_size != 0);
+	if(nblocks > SIZE_MAX / sizeof(*images))
+		return 1;
+
+	images = (unsigned char**)calloc((size_t)nblocks + 1, sizeof(*images));
+	imagelens = (uint64_t*)calloc((size_t)nblocks + 1, sizeof(*imagelens));
+	rc = !images || !imagelens;
 
-	/* Scan the memory again and, using the table
-	   previously built, encode it into the output memory. */
-	rc = write_code_table_to_memory(&cache, se, symbol_count);
 	if(rc == 0)
-		rc = do_memory_encode(&cache, bufin, bufinlen, se);
+		rc = encode_blocks(bufin, bufinlen, params->block_size, nblocks,
+						   images, imagelens, params);
+
+	/* The version, then the length in network byte order and the
+	   image of every block, then a block of length 0 and the
+	   index if one was asked for. */
+	len = 1 + 4;
+	for(i = 0; rc == 0 && i < nblocks; ++i)
+		len += 4 + imagelens[i];
+	if(params->block_index)
+		len += nblocks * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+
+	buf = rc || len > SIZE_MAX ? NULL : (unsigned char*)malloc((size_t)len);
+	if(buf)
+	{
+		len = 0;
+		buf[len++] = HUFFMAN_FORMAT_BLOCKS;
+		for(i = 0; i < nblocks; ++i)
+		{
+			blocklen = htonl((uint32_t)imagelens[i]);
+			memcpy(buf + len, &blocklen, sizeof(blocklen));
+			memcpy(buf + len + 4, images[i], (size_t)imagelens[i]);
+			len += 4 + imagelens[i];
+		}
+		memset(buf + len, 0, 4);
+		len += 4;
+
+		if(params->block_index)
+		{
+			uint64_t offset = 1;
+			for(i = 0; i < nblocks; ++i)
+			{
+				store_be64(buf + len, offset);
+				store_be64(buf + len + 8, i * params->block_size);
+				offset += 4 + imagelens[i];
+				len += INDEX_ENTRY_SIZE;
+			}
+			len += write_index_trailer(buf + len, bufinlen, nblocks);
+		}
 
-	/* Flush the cache. */
-	flush_cache(&cache);
+		*pbufout = buf;
+		*pbufoutlen = len;
+	}
+	else
+		rc = 1;
 
-	/* Free the Huffman tree. */
-	free_huffman_tree(root);
-	free_encoder(se);
-	free_cache(&cache);
+	for(i = 0; images && i < nblocks; ++i)
+		free(images[i]);
+	free(images);
+	free(imagelens);
+	return rc;
+}
+
+/*
+ * read_image_count reads the number of bytes that the legacy,
+ * V1 or V2 image at bufin decodes to.
+ */
+static int
+read_image_count(const unsigned char *bufin,
+				 uint64_t bufinlen,
+				 uint64_t *pcount)
+{
+	decode_code codes[MAX_SYMBOLS];
+	image_streams streams;
+	uint64_t i = 0;
+	unsigned int ncodes = 0;
+
+	return read_code_table_from_memory(bufin, bufinlen, &i, pcount,
+									   codes, &ncodes, &streams);
+}
+
+/*
+ * decode_image decodes the legacy, V1 or V2 image at bufin into
+ * bufout, which must have room for the count of bytes given by
+ * read_image_count.
+ */
+static int
+decode_image(const unsigned char *bufin,
+			 uint64_t bufinlen,
+			 unsigned char *bufout,
+			 uint64_t count)
+{
+	huffman_decoder decoder;
+	decode_code codes[MAX_SYMBOLS];
+	image_streams streams;
+	bit_reader br;
+	unsigned int ncodes = 0;
+	uint64_t data_count;
+	uint64_t i = 0;
+	int rc;
+
+	/* Read the Huffman code table and build the decode tables. */
+	if(read_code_table_from_memory(bufin, bufinlen, &i, &data_count,
+								   codes, &ncodes, &streams) ||
+	   data_count != count ||
+	   (ncodes == 0 && data_count > 0) ||
+	   init_decoder(&decoder, codes, ncodes))
+		return 1;
+
+	/* Decode the memory. */
+	if(streams.n > 1)
+		rc = decode_streams(&decoder, bufin + i, &streams, bufout, data_count);
+	else
+	{
+		init_bit_reader(&br, bufin + i, bufinlen - i);
+		rc = decode_memory(&decoder, &br, bufout, data_count);
+	}
+	free_decoder(&decoder);
 	return rc;
 }
 
+/*
+ * decode_blocks walks the blocks of a HUFFMAN_FORMAT_BLOCKS
+ * stream and sets *ptotal to the number of bytes they decode to.
+ * When bufout is not NULL the blocks are also decoded into it,
+ * one after the other.
+ */
+static int
+decode_blocks(const unsigned char *bufin,
+			  uint64_t bufinlen,
+			  unsigned char *bufout,
+			  uint64_t *ptotal)
+{
+	uint64_t i = 1, count;
+	uint32_t len;
+
+	*ptotal = 0;
+	for(;;)
+	{
+		if(memread(bufin, bufinlen, &i, &len, sizeof(len)))
+			return 1;
+
+		len = ntohl(len);
+		if(len == 0)
+			return 0;
+
+		if(len > bufinlen - i ||
+		   read_image_count(bufin + i, len, &count) ||
+		   count > UINT64_MAX - *ptotal)
+			return 1;
+
+		if(bufout && decode_image(bufin + i, len, bufout + *ptotal, count))
+			return 1;
+
+		*ptotal += count;
+		i += len;
+	}
+}
+
 int huffman_decode_memory(const unsigned char *bufin,
 						  unsigned int bufinlen,
 						  unsigned char **pbufout,
 						  unsigned int *pbufoutlen)
 {
-	huffman_node *root, *p;
-	unsigned int data_count;
-	unsigned int i = 0;
+	uint64_t len;
+
+	if(!pbufoutlen ||
+	   huffman_decode_memory64(bufin, bufinlen, pbufout, &len))
+		return 1;
+
+	if(len > UINT32_MAX)
+	{
+		free(*pbufout);
+		*pbufout = NULL;
+		return 1;
+	}
+
+	*pbufoutlen = (unsigned int)len;
+	return 0;
+}
+
+int huffman_decode_memory64(const unsigned char *bufin,
+							uint64_t bufinlen,
+							unsigned char **pbufout,
+							uint64_t *pbufoutlen)
+{
+	uint64_t data_count;
 	unsigned char *buf;
-	unsigned int bufcur = 0;
+	int blocks, rc;
 
 	/* Ensure the arguments are valid. */
 	if(!pbufout || !pbufoutlen)
 		return 1;
 
-	/* Read the Huffman code table. */
-	root = read_code_table_from_memory(bufin, bufinlen, &i, &data_count);
-	if(!root)
+	/* Get the size of the decoded data. */
+	blocks = bufinlen > 0 && bufin[0] == HUFFMAN_FORMAT_BLOCKS;
+	if(blocks)
+		rc = decode_blocks(bufin, bufinlen, NULL, &data_count);
+	else
+		rc = read_image_count(bufin, bufinlen, &data_count);
+	if(rc || data_count > SIZE_MAX)
 		return 1;
 
-	buf = (unsigned char*)malloc(data_count);
+	buf = (unsigned char*)malloc((size_t)data_count);
+	if(!buf && data_count > 0)
+		return 1;
 
 	/* Decode the memory. */
-	p = root;
-	for(; i < bufinlen && data_count > 0; ++i) 
+	if(blocks)
+		rc = decode_blocks(bufin, bufinlen, buf, &data_count);
+	else
+		rc = decode_image(bufin, bufinlen, buf, data_count);
+	if(rc)
+	{
+		free(buf);
+		return 1;
+	}
+
+	*pbufout = buf;
+	*pbufoutlen = data_count;
+	return 0;
+}
+
+/*
+ * add_index_entry adds the entry of a block that starts at offset
+ * in the stream and at start in the decoded data to the index of
+ * nblocks entries at *pindex.
+ */
+static int
+add_index_entry(unsigned char **pindex,
+				uint64_t nblocks,
+				uint64_t offset,
+				uint64_t start)
+{
+	unsigned char *tmp;
+
+	if(nblocks >= SIZE_MAX / INDEX_ENTRY_SIZE - 2)
+		return 1;
+
+	tmp = (unsigned char*)realloc(*pindex,
+								  (size_t)(nblocks + 1) * INDEX_ENTRY_SIZE);
+	if(!tmp)
+		return 1;
+
+	*pindex = tmp;
+	store_be64(tmp + nblocks * INDEX_ENTRY_SIZE, offset);
+	store_be64(tmp + nblocks * INDEX_ENTRY_SIZE + 8, start);
+	return 0;
+}
+
+/*
+ * write_stream_end writes the block of length 0 that ends a
+ * HUFFMAN_FORMAT_BLOCKS stream. If pindex is not NULL the index
+ * of the nblocks blocks at *pindex follows it.
+ */
+static int
+write_stream_end(FILE *out,
+				 unsigned char **pindex,
+				 uint64_t nblocks,
+				 uint64_t total)
+{
+	uint32_t blocklen = 0;
+	unsigned char *tmp;
+	size_t len;
+
+	if(fwrite(&blocklen, 1, sizeof(blocklen), out) != sizeof(blocklen))
+		return 1;
+
+	if(!pindex)
+		return 0;
+
+	len = (size_t)nblocks * INDEX_ENTRY_SIZE;
+	tmp = (unsigned char*)realloc(*pindex, len + INDEX_TRAILER_SIZE);
+	if(!tmp)
+		return 1;
+
+	*pindex = tmp;
+	len += write_index_trailer(tmp + len, total, nblocks);
+	return fwrite(tmp, 1, len, out) != len;
+}
+
+int huffman_encode_file(FILE *in, FILE *out)
+{
+	return huffman_encode_file_ex(in, out, NULL);
+}
+
+/*
+ * huffman_encode_file_ex codes the input one block at a time, so
+ * it only ever holds a block of input and its encoded image in
+ * memory. Each block has its own code table.
+ */
+int huffman_encode_file_ex(FILE *in, FILE *out, const huffman_params *params)
+{
+	huffman_params defaults;
+	unsigned char version = HUFFMAN_FORMAT_BLOCKS;
+	unsigned char *buf, *bufout, *index = NULL;
+	unsigned int len, bufoutlen;
+	uint64_t nblocks = 0, offset = 1, total = 0;
+	uint32_t blocklen;
+	int rc = 0;
+
+	if(!params)
+	{
+		huffman_params_init(&defaults);
+		params = &defaults;
+	}
+
+	/* Ensure the arguments are valid. */
+	if(!in || !out || params->block_size < 1 ||
+	   params->block_size > HUFFMAN_MAX_BLOCK_SIZE)
+		return 1;
+
+	buf = (unsigned char*)malloc(params->block_size);
+	if(!buf)
+		return 1;
+
+	if(fwrite(&version, 1, sizeof(version), out) != sizeof(version))
+		rc = 1;
+
+	while(rc == 0 &&
+		  (len = (unsigned int)fread(buf, 1, params->block_size, in)) > 0)
 	{
-		unsigned char byte = bufin[i];
-		unsigned char mask = 1;
-		while(data_count > 0 && mask)
+		if(huffman_encode_memory_ex(buf, len, &bufout, &bufoutlen, params))
 		{
-			p = byte & mask ? p->one : p->zero;
-			mask <<= 1;
+			rc = 1;
+			break;
+		}
+
+		/* Write the length of the block in network byte order,
+		   then the block. */
+		blocklen = htonl(bufoutlen);
+		if((params->block_index &&
+			add_index_entry(&index, nblocks, offset, total)) ||
+		   fwrite(&blocklen, 1, sizeof(blocklen), out) != sizeof(blocklen) ||
+		   fwrite(bufout, 1, bufoutlen, out) != bufoutlen)
+			rc = 1;
+
+		free(bufout);
+		++nblocks;
+		offset += sizeof(blocklen) + bufoutlen;
+		total += len;
+	}
+
+	/* A block of length 0 ends the stream. */
+	if(rc == 0 && (ferror(in) ||
+				   write_stream_end(out, params->block_index ? &index : NULL,
+									nblocks, total)))
+		rc = 1;
+
+	free(buf);
+	free(index);
+	return rc;
+}
+
+/*
+ * decode_whole_file reads all of in into memory and decodes
+ * it with huffman_decode_memory. The formats that are a single
+ * image cannot be decoded in pieces.
+ */
+static int
+decode_whole_file(FILE *in, FILE *out)
+{
+	unsigned char *buf = NULL, *bufout = NULL;
+	size_t len = 0, cur = 0;
+	uint64_t bufoutlen = 0;
+	int rc;
 
-			if(p->isLeaf)
+	/* Read the file into memory, doubling the buffer as it fills. */
+	while(!feof(in) && !ferror(in))
+	{
+		if(cur == len)
+		{
+			unsigned char *tmp;
+			len = len ? len * 2 : 1024;
+			tmp = (unsigned char*)realloc(buf, len);
+			if(!tmp)
 			{
-				buf[bufcur++] = p->symbol;
-				p = root;
-				--data_count;
+				free(buf);
+				return 1;
 			}
+			buf = tmp;
 		}
+
+		cur += fread(buf + cur, 1, len - cur, in);
 	}
 
-	free_huffman_tree(root);
-	*pbufout = buf;
-	*pbufoutlen = bufcur;
-	return 0;
+	rc = ferror(in) || huffman_decode_memory64(buf, cur, &bufout, &bufoutlen);
+	free(buf);
+	if(rc)
+		return 1;
+
+	/* Write the memory to the file. */
+	rc = fwrite(bufout, 1, bufoutlen, out) != bufoutlen;
+	free(bufout);
+	return rc;
+}
+
+int huffman_decode_file(FILE *in, FILE *out)
+{
+	unsigned char *buf = NULL, *bufout = NULL;
+	unsigned int buflen = 0, bufoutlen = 0;
+	uint32_t blocklen;
+	uint64_t count;
+	int c, rc = 0;
+
+	/* Ensure the arguments are valid. */
+	if(!in || !out)
+		return 1;
+
+	c = fgetc(in);
+	if(c == EOF)
+		return 1;
+
+	if(c != HUFFMAN_FORMAT_BLOCKS)
+	{
+		ungetc(c, in);
+		return decode_whole_file(in, out);
+	}
+
+	/* Decode a block at a time, reusing the buffers. */
+	for(;;)
+	{
+		if(fread(&blocklen, 1, sizeof(blocklen), in) != sizeof(blocklen))
+		{
+			rc = 1;
+			break;
+		}
+
+		blocklen = ntohl(blocklen);
+		if(blocklen == 0)
+			break;
+
+		if(blocklen > MAX_BLOCK_IMAGE_SIZE)
+		{
+			rc = 1;
+			break;
+		}
+
+		if(blocklen > buflen)
+		{
+			unsigned char *tmp = (unsigned char*)realloc(buf, blocklen);
+			if(!tmp)
+			{
+				rc = 1;
+				break;
+			}
+			buf = tmp;
+			buflen = blocklen;
+		}
+
+		if(fread(buf, 1, blocklen, in) != blocklen ||
+		   read_image_count(buf, blocklen, &count) ||
+		   count > HUFFMAN_MAX_BLOCK_SIZE)
+		{
+			rc = 1;
+			break;
+		}
+
+		if(count > bufoutlen)
+		{
+			unsigned char *tmp = (unsigned char*)realloc(bufout, (size_t)count);
+			if(!tmp)
+			{
+				rc = 1;
+				break;
+			}
+			bufout = tmp;
+			bufoutlen = (unsigned int)count;
+		}
+
+		if(decode_image(buf, blocklen, bufout, count) ||
+		   fwrite(bufout, 1, (size_t)count, out) != count)
+		{
+			rc = 1;
+			break;
+		}
+	}
+
+	free(buf);
+	free(bufout);
+	return rc;
 }
@@ -10,15 +10,88 @@
 #include <stdio.h>
 #include <stdint.h>
 
+/* The longest code the encoder ever produces. */
+#define HUFFMAN_MAX_CODE_BITS 32
+
+/* The default and the largest number of input bytes
+   in each block written by huffman_encode_file. */
+#define HUFFMAN_DEFAULT_BLOCK_SIZE (1u << 20)
+#define HUFFMAN_MAX_BLOCK_SIZE (1u << 26)
+
+/* The largest number of bitstreams an image can be split into. */
+#define HUFFMAN_MAX_STREAMS 8
+
+typedef struct huffman_params_tag
+{
+	/* The longest code to produce, from 1 to HUFFMAN_MAX_CODE_BITS.
+	   Short limits such as 11 or 12 keep the decode tables small,
+	   at a slight cost in compression on skewed input. The limit
+	   is raised if it leaves too few codes for the symbols. */
+	unsigned int max_bits;
+
+	/* The number of input bytes in each block written by
+	   huffman_encode_file_ex and huffman_encode_memory_blocks,
+	   from 1 to HUFFMAN_MAX_BLOCK_SIZE.
+	   Every block has its own code table, and memory use
+	   depends on the block size rather than the input size. */
+	unsigned int block_size;
+
+	/* Non-zero to end the blocks with an index of where each one
+	   starts in the encoded and the decoded data, so that a
+	   decoder can find every block without walking the others.
+	   Decoders that do not use the index skip it. */
+	int block_index;
+
+	/* The number of bitstreams each image is split into, from 1 to
+	   HUFFMAN_MAX_STREAMS. The streams share the code table and
+	   take the symbols in turn, so a decoder can follow several of
+	   them at once; 4 or 8 streams decode fastest on most CPUs.
+	   Decoders older than this option cannot read more than 1. */
+	unsigned int streams;
+} huffman_params;
+
+void huffman_params_init(huffman_params *params);
+
 int huffman_encode_file(FILE *in, FILE *out);
+int huffman_encode_file_ex(FILE *in, FILE *out, const huffman_params *params);
 int huffman_decode_file(FILE *in, FILE *out);
 int huffman_encode_memory(const unsigned char *bufin,
 						  uint32_t bufinlen,
 						  unsigned char **pbufout,
 						  uint32_t *pbufoutlen);
+int huffman_encode_memory_ex(const unsigned char *bufin,
+							 uint32_t bufinlen,
+							 unsigned char **pbufout,
+							 uint32_t *pbufoutlen,
+							 const huffman_params *params);
 int huffman_decode_memory(const unsigned char *bufin,
 						  uint32_t bufinlen,
 						  unsigned char **bufout,
 						  uint32_t *pbufoutlen);
 
+/* The same as above for buffers of 4 GiB or more. The 32-bit
+   versions fail when a length does not fit in 32 bits. */
+int huffman_encode_memory64(const unsigned char *bufin,
+							uint64_t bufinlen,
+							unsigned char **pbufout,
+							uint64_t *pbufoutlen);
+int huffman_encode_memory64_ex(const unsigned char *bufin,
+							   uint64_t bufinlen,
+							   unsigned char **pbufout,
+							   uint64_t *pbufoutlen,
+							   const huffman_params *params);
+int huffman_decode_memory64(const unsigned char *bufin,
+							uint64_t bufinlen,
+							unsigned char **bufout,
+							uint64_t *pbufoutlen);
+
+/* Code the input in blocks of params->block_size bytes, each with
+   its own code table, like huffman_encode_file_ex does. The blocks
+   are independent of one another, so they can be coded at once. */
+int huffman_encode_memory_blocks(const unsigned char *bufin,
+								 uint64_t bufinlen,
+								 unsigned char **pbufout,
+								 uint64_t *pbufoutlen,
+								 const huffman_params *params);
+
 #endif